@@ -0,0 +1,49 @@
+// Diffs two result files written with --out and flags regressions.
+//
+//   node bench/compare.js baseline.json current.json [--threshold 10]
+//
+// Results are matched on everything except their measurements. Exits with 1
+// if any throughput fell, or p99 latency rose, by more than the threshold
+// percent.
+
+const fs = require('fs');
+const { arg } = require('./stats');
+
+const [baselineFile, currentFile] = process.argv.slice(2).filter(a => a.endsWith('.json'));
+if (!baselineFile || !currentFile) {
+    console.error('usage: node bench/compare.js baseline.json current.json [--threshold 10]');
+    process.exit(2);
+}
+const threshold = Number(arg('threshold', 10));
+
+// Higher is better for throughput, lower for latency.
+const METRICS = { opsPerSec: 1, itemsPerSec: 1, p99Ms: -1, p99Ns: -1 };
+
+function key(result) {
+    const identity = {};
+    for (const [name, value] of Object.entries(result)) {
+        if (typeof value === 'string' || name === 'concurrency' || name === 'pool') identity[name] = value;
+    }
+    return JSON.stringify(identity);
+}
+
+const load = file => JSON.parse(fs.readFileSync(file, 'utf8')).results;
+const baseline = new Map(load(baselineFile).map(r => [key(r), r]));
+let regressions = 0;
+
+for (const current of load(currentFile)) {
+    const before = baseline.get(key(current));
+    if (!before) continue;
+    for (const [metric, direction] of Object.entries(METRICS)) {
+        if (!(metric in current) || !before[metric]) continue;
+        const change = (current[metric] - before[metric]) / before[metric] * 100;
+        const regressed = change * direction < -threshold;
+        if (regressed) regressions++;
+        const label = [current.bench, current.driver].filter(Boolean).join(' ');
+        console.log(`${regressed ? 'REGRESSION' : 'ok        '} ${label.padEnd(28)} ${metric.padEnd(11)} ` +
+                    `${String(before[metric]).padStart(12)} -> ${String(current[metric]).padStart(12)} ` +
+                    `(${change >= 0 ? '+' : ''}${change.toFixed(1)}%)`);
+    }
+}
+
+process.exit(regressions ? 1 : 0);
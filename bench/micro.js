@@ -0,0 +1,51 @@
+// N-API micro-benchmarks: row conversion and parameter marshalling against
+// synthetic results, with no server. Needs the benchmark addon:
+//
+//   npx node-gyp rebuild -C bench/native
+//   node bench/micro.js [--rows 10000] [--iterations 50] [--out micro.json]
+
+const path = require('path');
+const { summarize, report, arg, finish } = require('./stats');
+
+let native;
+try {
+    native = require(path.join(__dirname, 'native', 'build', 'Release', 'pgnx_bench.node'));
+} catch (error) {
+    console.error('Benchmark addon not built; run: npx node-gyp rebuild -C bench/native');
+    process.exit(1);
+}
+
+const rows = Number(arg('rows', 10000));
+const iterations = Number(arg('iterations', 50));
+const COLUMNS = 8;
+
+function run(name, items, time, count = iterations) {
+    time(3); // warm up
+    const ns = summarize(time(count));
+    const result = {
+        bench: name,
+        iterations: count,
+        meanNs: Math.round(ns.mean),
+        p50Ns: Math.round(ns.p50),
+        p99Ns: Math.round(ns.p99),
+        itemsPerSec: Math.round(items / ns.mean * 1e9),
+    };
+    report(result, `${name.padEnd(28)} ${(ns.p50 / 1e3).toFixed(1).padStart(10)} us p50 ` +
+                   `${result.itemsPerSec.toLocaleString().padStart(14)} items/sec`);
+}
+
+for (const binary of [false, true]) {
+    const format = binary ? 'binary' : 'text';
+    const cells = rows * COLUMNS;
+    run(`convert.${format}`, rows, n => native.convert(rows, binary, n));
+    run(`convertBuffered.${format}`, rows, n => native.convertBuffered(rows, binary, n));
+    run(`fastConvert.${format}`, cells, n => native.fastConvert(rows, binary, n));
+}
+
+const params = [42, 'text value', true, null, 3.25, new Date(0), Buffer.from('bytes'), [1, 2, 3], { a: 1 }, 2n ** 40n];
+for (const binary of [false, true]) {
+    // A call takes microseconds, so many more runs give a stable picture.
+    run(`params.${binary ? 'binary' : 'text'}`, params.length, n => native.params(params, binary, n), iterations * 1000);
+}
+
+finish();
@@ -0,0 +1,82 @@
+// Benchmark-only addon timing the N-API side of the hot paths against
+// synthetic results, with no server involved. Each function runs its body
+// `iterations` times and returns the nanoseconds of every run; bench/micro.js
+// turns them into results.
+//
+//   npx node-gyp rebuild -C bench/native && node bench/micro.js
+
+#include <napi.h>
+#include "../../src/convert.h"
+#include "../../src/params.h"
+#include "synthetic.h"
+#include <chrono>
+#include <functional>
+#include <memory>
+
+using Clock = std::chrono::steady_clock;
+
+static Napi::Value Time(Napi::Env env, uint32_t iterations, const std::function<void()>& body) {
+    auto samples = Napi::Float64Array::New(env, iterations);
+    for (uint32_t i = 0; i < iterations; ++i) {
+        // Each run's values become garbage as soon as its scope closes.
+        Napi::HandleScope scope(env);
+        auto before = Clock::now();
+        body();
+        samples[i] = std::chrono::duration<double, std::nano>(Clock::now() - before).count();
+    }
+    return samples;
+}
+
+struct ResultDeleter {
+    void operator()(PGresult* res) const { PQclear(res); }
+};
+using Result = std::unique_ptr<PGresult, ResultDeleter>;
+
+// convert(rows, binary, iterations): ConvertResult straight off a PGresult.
+static Napi::Value Convert(const Napi::CallbackInfo& info) {
+    auto env = info.Env();
+    Result res(SyntheticResult(info[0].As<Napi::Number>().Int32Value(), info[1].ToBoolean().Value()));
+    return Time(env, info[2].As<Napi::Number>().Uint32Value(), [&]() { ConvertResult(env, res.get()); });
+}
+
+// convertBuffered(rows, binary, iterations): ConvertResult of a decoded
+// ResultBuffer, which is all the JS thread does for offloaded results.
+static Napi::Value ConvertBuffered(const Napi::CallbackInfo& info) {
+    auto env = info.Env();
+    Result res(SyntheticResult(info[0].As<Napi::Number>().Int32Value(), info[1].ToBoolean().Value()));
+    ResultBuffer buffer(res.get());
+    return Time(env, info[2].As<Napi::Number>().Uint32Value(), [&]() { ConvertResult(env, buffer); });
+}
+
+// fastConvert(rows, binary, iterations): per-cell conversion alone, without
+// building row objects.
+static Napi::Value FastConvertCells(const Napi::CallbackInfo& info) {
+    auto env = info.Env();
+    Result res(SyntheticResult(info[0].As<Napi::Number>().Int32Value(), info[1].ToBoolean().Value()));
+    int rows = PQntuples(res.get());
+    int cols = PQnfields(res.get());
+    return Time(env, info[2].As<Napi::Number>().Uint32Value(), [&]() {
+        for (int j = 0; j < cols; ++j) {
+            Oid type = PQftype(res.get(), j);
+            for (int i = 0; i < rows; ++i) FastConvert(env, res.get(), i, j, type);
+        }
+    });
+}
+
+// params(values, binary, iterations): ReadParams on a JS array.
+static Napi::Value Params(const Napi::CallbackInfo& info) {
+    auto env = info.Env();
+    auto values = info[0];
+    bool binary = info[1].ToBoolean().Value();
+    return Time(env, info[2].As<Napi::Number>().Uint32Value(), [&]() { ReadParams(values, binary); });
+}
+
+static Napi::Object Init(Napi::Env env, Napi::Object exports) {
+    exports.Set("convert", Napi::Function::New(env, Convert));
+    exports.Set("convertBuffered", Napi::Function::New(env, ConvertBuffered));
+    exports.Set("fastConvert", Napi::Function::New(env, FastConvertCells));
+    exports.Set("params", Napi::Function::New(env, Params));
+    return exports;
+}
+
+NODE_API_MODULE(pgnx_bench, Init)
@@ -0,0 +1,79 @@
+// Micro-benchmarks of the driver's libpq-side hot paths, run without a
+// server or Node. Each line of output is one JSON result:
+//
+//   make bench-native
+//   ./bench/native/micro [rows]
+//
+// N-API conversion and parameter marshalling need a live V8; see
+// bench/micro.js for those.
+
+#include "../../src/metrics.h"
+#include "../../src/result_buffer.h"
+#include "synthetic.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <string>
+#include <vector>
+
+static volatile size_t sink;
+
+// Runs `body` until `minTime` has passed (and at least 5 times), timing each
+// call, and prints the per-call distribution.
+static void Run(const std::string& name, size_t itemsPerOp, const std::function<size_t()>& body) {
+    using Clock = std::chrono::steady_clock;
+    constexpr auto minTime = std::chrono::milliseconds(500);
+
+    for (int i = 0; i < 3; ++i) sink = sink + body();
+
+    std::vector<double> samples;
+    auto started = Clock::now();
+    while (samples.size() < 5 || Clock::now() - started < minTime) {
+        auto before = Clock::now();
+        sink = sink + body();
+        samples.push_back(std::chrono::duration<double, std::nano>(Clock::now() - before).count());
+    }
+    std::sort(samples.begin(), samples.end());
+
+    double total = 0;
+    for (double ns : samples) total += ns;
+    double mean = total / samples.size();
+    auto at = [&](double q) { return samples[static_cast<size_t>(q * (samples.size() - 1))]; };
+    std::printf("{\"bench\":\"%s\",\"iterations\":%zu,\"meanNs\":%.0f,\"p50Ns\":%.0f,\"p99Ns\":%.0f,"
+                "\"opsPerSec\":%.1f,\"itemsPerSec\":%.0f}\n",
+                name.c_str(), samples.size(), mean, at(0.5), at(0.99), 1e9 / mean, 1e9 / mean * itemsPerOp);
+}
+
+int main(int argc, char** argv) {
+    int rows = argc > 1 ? std::atoi(argv[1]) : 10000;
+    const size_t cells = static_cast<size_t>(rows) * 8;
+
+    for (bool binary : {false, true}) {
+        PGresult* res = SyntheticResult(rows, binary);
+        Run(std::string("decode.") + (binary ? "binary" : "text"), cells, [&]() {
+            ResultBuffer buffer(res);
+            return buffer.byteSize();
+        });
+        PQclear(res);
+    }
+
+    const std::vector<std::string> queries = {
+        "SELECT id, name FROM users WHERE id = $1",
+        "SELECT * FROM orders WHERE customer = 'O''Brien' AND total > 100.50 -- hot path\n ORDER BY created DESC LIMIT 20",
+        "INSERT INTO events (kind, payload) VALUES ('click', $$ {\"x\": 1} $$), ('view', $$ {} $$)",
+    };
+    Run("fingerprint", queries.size(), [&]() {
+        size_t length = 0;
+        for (const auto& sql : queries) length += Fingerprint(sql).size();
+        return length;
+    });
+
+    LatencyHistogram histogram;
+    Run("histogram.record", 1000, [&]() {
+        for (int i = 0; i < 1000; ++i) histogram.record(std::chrono::microseconds(i * 37));
+        return static_cast<size_t>(histogram.count());
+    });
+    return 0;
+}
@@ -0,0 +1,65 @@
+#pragma once
+#include "../../src/pg_types.h"
+#include <libpq-fe.h>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+// A PGresult shaped like bench/rows.js's query (8 columns: int4, int4, text,
+// bool, float8, text, timestamptz, text) built without a server, in text or
+// binary format, so decode paths can be timed in isolation.
+inline std::string BigEndianBytes(uint64_t value, int bytes) {
+    std::string out(bytes, '\0');
+    for (int i = bytes - 1; i >= 0; --i, value >>= 8) out[i] = static_cast<char>(value & 0xff);
+    return out;
+}
+
+inline PGresult* SyntheticResult(int rows, bool binary) {
+    static const struct {
+        const char* name;
+        Oid type;
+        int size;
+    } columns[] = {
+        {"id", INT4OID, 4},         {"score", INT4OID, 4},  {"name", TEXTOID, -1},
+        {"active", BOOLOID, 1},     {"ratio", FLOAT8OID, 8}, {"grp", TEXTOID, -1},
+        {"created", TIMESTAMPTZOID, 8}, {"code", TEXTOID, -1},
+    };
+    constexpr int cols = sizeof(columns) / sizeof(columns[0]);
+
+    PGresult* res = PQmakeEmptyPGresult(nullptr, PGRES_TUPLES_OK);
+    PGresAttDesc attrs[cols];
+    for (int j = 0; j < cols; ++j) {
+        attrs[j] = PGresAttDesc{const_cast<char*>(columns[j].name), 0, 0, binary ? 1 : 0,
+                                columns[j].type, columns[j].size, -1};
+    }
+    PQsetResultAttrs(res, cols, attrs);
+
+    for (int i = 0; i < rows; ++i) {
+        double ratio = i / 3.0;
+        std::string values[cols];
+        if (binary) {
+            uint64_t ratioBits;
+            std::memcpy(&ratioBits, &ratio, sizeof(ratio));
+            // 2024-01-01 in microseconds since 2000-01-01.
+            int64_t created = 757382400000000LL + i;
+            values[0] = BigEndianBytes(static_cast<uint32_t>(i), 4);
+            values[1] = BigEndianBytes(static_cast<uint32_t>(i * 2), 4);
+            values[3] = std::string(1, i % 2 == 0 ? '\1' : '\0');
+            values[4] = BigEndianBytes(ratioBits, 8);
+            values[6] = BigEndianBytes(static_cast<uint64_t>(created), 8);
+        } else {
+            values[0] = std::to_string(i);
+            values[1] = std::to_string(i * 2);
+            values[3] = i % 2 == 0 ? "t" : "f";
+            values[4] = std::to_string(ratio);
+            values[6] = "2024-01-01 00:00:00.000000+00";
+        }
+        values[2] = "name-" + std::to_string(i);
+        values[5] = "group-" + std::to_string(i % 10);
+        values[7] = std::to_string(i);
+        for (int j = 0; j < cols; ++j) {
+            PQsetvalue(res, i, j, const_cast<char*>(values[j].data()), static_cast<int>(values[j].size()));
+        }
+    }
+    return res;
+}
@@ -0,0 +1,46 @@
+// Shared by the benchmark scripts. Every result is one JSON object: printed
+// as a line on stdout, summarized for humans on stderr, and with
+// `--out file.json` collected into one file that bench/compare.js can diff.
+
+const fs = require('fs');
+
+const results = [];
+
+function percentile(sorted, q) {
+    if (sorted.length === 0) return 0;
+    return sorted[Math.min(sorted.length - 1, Math.floor(q * (sorted.length - 1)))];
+}
+
+// Latency samples, in any unit, to { mean, p50, p99, max } in that unit.
+function summarize(samples) {
+    const sorted = Float64Array.from(samples).sort();
+    let total = 0;
+    for (const value of sorted) total += value;
+    return {
+        mean: sorted.length ? total / sorted.length : 0,
+        p50: percentile(sorted, 0.5),
+        p99: percentile(sorted, 0.99),
+        max: sorted.length ? sorted[sorted.length - 1] : 0,
+    };
+}
+
+function report(result, summary) {
+    results.push(result);
+    console.log(JSON.stringify(result));
+    if (summary) console.error(summary);
+}
+
+function arg(name, fallback) {
+    const index = process.argv.indexOf(`--${name}`);
+    return index === -1 ? fallback : process.argv[index + 1];
+}
+
+function finish() {
+    const out = arg('out');
+    if (!out) return;
+    const meta = { node: process.version, platform: `${process.platform}-${process.arch}`, date: new Date().toISOString() };
+    fs.writeFileSync(out, JSON.stringify({ meta, results }, null, 2) + '\n');
+    console.error(`\nwrote ${out}`);
+}
+
+module.exports = { summarize, report, arg, finish };
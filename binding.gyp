@@ -1,7 +1,7 @@
 {
   "targets": [{
     "target_name": "pgnx",
-    "sources": ["src/addon.cpp", "src/connection_pool.cpp", "src/connection.cpp", "src/listener.cpp"],
+    "sources": ["src/addon.cpp", "src/connection_pool.cpp", "src/connection.cpp", "src/query_engine.cpp", "src/params.cpp", "src/convert.cpp", "src/columnar.cpp", "src/result_buffer.cpp", "src/result_cache.cpp", "src/listener.cpp", "src/metrics.cpp", "src/replica_set.cpp"],
     "include_dirs": [
       "<!@(node -p \"require('node-addon-api').include\")",
       "/tmp/pgnx-deps/include"
@@ -1,3 +1,5 @@
+import { Readable, Writable } from 'stream';
+
 export interface ConnectionConfig {
   connectionString: string;
   poolSize?: number;
@@ -8,35 +10,299 @@ export interface QueryResult<T = any> {
   rowCount: number;
 }
 
+export type ColumnValues =
+  | Int16Array
+  | Int32Array
+  | BigInt64Array
+  | Float32Array
+  | Float64Array
+  | Uint8Array
+  | any[];
+
+export interface ColumnarResult {
+  rowCount: number;
+  /** One array per column. int2/int4/int8/float4/float8/bool columns are typed arrays over one ArrayBuffer. */
+  columns: Record<string, ColumnValues>;
+  /** Per typed column with NULLs: 1 marks a NULL (stored as 0, or NaN for floats). */
+  nulls: Record<string, Uint8Array>;
+}
+
+export interface CancelOptions {
+  /** Reject and cancel the query on the server once it has taken this long, queueing included. */
+  timeoutMs?: number;
+  /** Reject with `signal.reason` and cancel the query on the server when aborted. */
+  signal?: AbortSignal;
+}
+
+export interface DispatchOptions {
+  /** Run on a replica when the connection has `replicas`. */
+  readOnly?: boolean;
+  /** Interactive work is served first; batch work is capped by `maxBatch` (default 'interactive'). */
+  priority?: 'interactive' | 'batch';
+}
+
+export interface QueryOptions extends CancelOptions, DispatchOptions {
+  rowMode?: 'objects' | 'columnar';
+  /** Serve repeats of this query (same SQL and params) from the result cache; needs the connection's `cache` option. */
+  cache?: boolean | { ttlMillis?: number; tags?: string[] };
+  /** Return string and bytea columns (all, or the named ones) as Buffers over the result's memory, without copying. */
+  buffers?: boolean | string[];
+}
+
+export interface ResultCacheOptions {
+  /** Memory bound for cached rows (default 16 MiB). */
+  maxBytes?: number;
+  /** Default entry lifetime (default 60000). */
+  ttlMillis?: number;
+  /** NOTIFY channel whose payload names tags to evict (comma-separated; empty or '*' clears all). */
+  channel?: string;
+}
+
+export interface ResultCacheStats {
+  hits: number;
+  misses: number;
+  hitRatio: number;
+  entries: number;
+  bytes: number;
+  maxBytes: number;
+  evictions: number;
+  invalidations: number;
+}
+
+export interface StreamOptions extends DispatchOptions {
+  /** Rows fetched per batch (default 1000). */
+  batchSize?: number;
+}
+
+export class QueryStream<T = any> implements AsyncIterable<T> {
+  /** Next batch of rows, or null once the query is done. */
+  nextBatch(): Promise<T[] | null>;
+  /** Stops early; the connection is closed instead of read to the end. */
+  cancel(): void;
+  [Symbol.asyncIterator](): AsyncIterator<T>;
+}
+
+export class CopyFromStream extends Writable {
+  /** Rows copied, set once the stream has finished. */
+  rowCount: number;
+}
+
+export class CopyToStream extends Readable {}
+
+export interface PipelineQuery {
+  text: string;
+  values?: any[];
+}
+
+export interface PipelineOptions extends CancelOptions, DispatchOptions {
+  /** 'abort' (default): one implicit transaction, first failure rejects. 'isolate': per-statement errors. */
+  mode?: 'abort' | 'isolate';
+}
+
+export interface PipelineResult<T = any> extends QueryResult<T> {
+  error?: Error;
+}
+
+export interface ConnectionOptions {
+  /** Per-connection LRU of auto-prepared query() statements; 0 (default) disables it. */
+  statementCacheSize?: number;
+  /** Use the binary wire format for results and float/boolean/BigInt/Date parameters; integer numbers stay untyped. */
+  binary?: boolean;
+  /** Send concurrent single-statement query()/execute() calls together as one pipeline. */
+  autoBatch?: boolean;
+  /** How long auto-batching waits for more queries, in microseconds (rounded up to ms; default 0 = end of the current tick). */
+  batchWindowMicros?: number;
+  /** Enable the in-process result cache for queries run with `{ cache }`. */
+  cache?: boolean | ResultCacheOptions;
+  /** Reject a query that has waited this long for a pooled connection; 0 (default) waits indefinitely. */
+  connectionTimeoutMillis?: number;
+  /** Connections kept open even when idle and opened in the background at startup (default 1). */
+  min?: number;
+  /** Close idle connections above `min` after this long; 0 keeps them (default 300000). */
+  idleTimeoutMillis?: number;
+  /** Replace connections after roughly this long, with up to 10% jitter; 0 (default) keeps them. */
+  maxLifetimeMillis?: number;
+  /** Draw from one process-wide pool shared by every Connection, on any thread, with the same connection string and pool settings. */
+  sharedPool?: boolean;
+  /** Connection strings of streaming replicas that `readOnly` queries are spread over. */
+  replicas?: string[];
+  /** How reads pick a replica (default 'leastOutstanding'). */
+  balance?: 'leastOutstanding' | 'latency';
+  /** Connections batch work can never hold (default 0). */
+  reservedInteractive?: number;
+  /** Connections interactive work can never hold (default 0). */
+  reservedBatch?: number;
+  /** Most connections batch work may hold at once; 0 (default) leaves only `reservedInteractive` as a cap. */
+  maxBatch?: number;
+  /** Reject new requests with code 'POOL_OVERLOADED' once this many are queued; 0 (default) is unbounded. */
+  maxQueue?: number;
+  /** Reject new requests with code 'POOL_OVERLOADED' while the oldest queued one of their priority has waited this long; 0 (default) is off. */
+  maxQueueWaitMillis?: number;
+  /** Called for every query that takes at least `slowQueryMillis` from submission to settling. */
+  onSlowQuery?: (query: SlowQuery) => void;
+  /** Threshold for `onSlowQuery` (default 1000). */
+  slowQueryMillis?: number;
+}
+
+export interface ParallelQueryOptions extends CancelOptions {
+  rowMode?: 'objects' | 'columnar';
+  /** Output column the ranges split on. */
+  partitionBy: string;
+  /** `[low, high)` per partition, in result order; a null bound is open. */
+  ranges: Array<[any, any]>;
+  /** Most connections to use at once (default and cap: the pool size). */
+  concurrency?: number;
+}
+
+export interface SlowQuery {
+  /** The SQL with literals replaced by `?`; pipelines join their statements with `; `. */
+  fingerprint: string;
+  statements: number;
+  durationMs: number;
+  acquireMs: number;
+  executeMs: number;
+  rows: number;
+  /** Answered from the result cache. */
+  cached?: boolean;
+  error?: string;
+}
+
+export interface LatencySnapshot {
+  count: number;
+  meanMs: number;
+  p50Ms: number;
+  p90Ms: number;
+  p99Ms: number;
+  maxMs: number;
+}
+
+export interface Metrics {
+  queries: number;
+  errors: number;
+  rows: number;
+  /** Memory libpq used for the results, a close proxy for bytes received. */
+  bytes: number;
+  slowQueries: number;
+  /** Answered from the result cache. */
+  cached: number;
+  /** Waiting for a pooled connection, or a pinned client's turn. */
+  acquire: LatencySnapshot;
+  /** From sending a query to its last result arriving. */
+  execute: LatencySnapshot;
+  /** Turning results into JS values on the JS thread. */
+  decode: LatencySnapshot;
+  total: LatencySnapshot;
+  connect: LatencySnapshot & { failures: number };
+}
+
+export interface Notification {
+  channel: string;
+  payload: string;
+  /** Process ID of the backend that sent the notification. */
+  pid: number;
+}
+
+export interface StatementStats {
+  hits: number;
+  misses: number;
+  evictions: number;
+}
+
+export interface QueueStats {
+  waiting: number;
+  peakWaiting: number;
+  waits: number;
+  avgWaitMs: number;
+  timeouts: number;
+  /** Requests rejected by `maxQueue` or `maxQueueWaitMillis`. */
+  shed: number;
+}
+
+export interface PriorityStats {
+  /** Connections held by this priority. */
+  busy: number;
+  waiting: number;
+}
+
+export interface HostStatus {
+  /** host:port from the connection string. */
+  host: string;
+  role: 'primary' | 'replica';
+  available: number;
+  current: number;
+  max: number;
+  /** Replicas only: reads queued or running there. */
+  outstanding?: number;
+  /** Replicas only: moving average of execute time. */
+  latencyMs?: number;
+  queries?: number;
+  /** Replicas only: false while ejected after a connection failure. */
+  healthy?: boolean;
+  ejections?: number;
+}
+
+export interface PoolStatus {
+  available: number;
+  current: number;
+  max: number;
+  closed: boolean;
+  statements: StatementStats;
+  queue: QueueStats;
+  priorities: { interactive: PriorityStats; batch: PriorityStats };
+  /** Present when the result cache is enabled. */
+  cache?: ResultCacheStats;
+  /** Present with `replicas`: the primary first, then each replica. */
+  hosts?: HostStatus[];
+}
+
 export class Connection {
-  constructor(connectionString: string, poolSize?: number);
+  constructor(connectionString: string, poolSize?: number, options?: ConnectionOptions);
   
-  query<T = any>(sql: string, params?: any[]): Promise<T[]>;
+  query<T = any>(sql: string, params?: any[], options?: QueryOptions & { rowMode?: 'objects' }): Promise<T[]>;
+  query(sql: string, params: any[] | undefined, options: { rowMode: 'columnar' }): Promise<ColumnarResult>;
   prepare(name: string, sql: string): void;
-  execute<T = any>(name: string, params?: any[]): Promise<T[]>;
-  pipeline(queries: string[]): Promise<number[]>;
-  listen(channel: string, callback: (payload: string) => void): void;
+  execute<T = any>(name: string, params?: any[], options?: CancelOptions & DispatchOptions & Pick<QueryOptions, 'buffers'>): Promise<T[]>;
+  stream<T = any>(sql: string, params?: any[], options?: StreamOptions): QueryStream<T>;
+  copyFrom(sql: string): CopyFromStream;
+  copyTo(sql: string): CopyToStream;
+  /** Pins one pooled connection to the returned client until it is released. */
+  connect(): Promise<PoolClient>;
+  /** connect() plus BEGIN; finish with the client's commit() or rollback(). */
+  begin(): Promise<PoolClient>;
+  /** Runs `sql` once per range on separate connections sharing one snapshot; rows in range order. */
+  parallelQuery<T = any>(sql: string, params: any[] | undefined, options: ParallelQueryOptions): Promise<T[]>;
+  parallelQuery<T = any>(sql: string, options: ParallelQueryOptions): Promise<T[]>;
+  parallelQuery(sql: string, params: any[] | undefined, options: ParallelQueryOptions & { rowMode: 'columnar' }): Promise<ColumnarResult>;
+  pipeline<T = any>(queries: Array<string | PipelineQuery>, options?: PipelineOptions): Promise<PipelineResult<T>[]>;
+  listen(channel: string, callback: (notification: Notification) => void): void;
   unlisten(channel: string): void;
   close(): void;
-  poolStatus?(): { available: number; current: number; max: number; closed: boolean };
+  poolStatus(): PoolStatus;
+  metrics(): Metrics;
 }
 
-export interface PoolConfig {
-  min?: number;
+export interface PoolConfig extends ConnectionOptions {
+  connectionString: string;
+  /** Pool size (default 10). */
   max?: number;
-  idleTimeoutMillis?: number;
-  connectionTimeoutMillis?: number;
 }
 
 export class Pool {
-  constructor(config: string | ConnectionConfig);
+  constructor(config: string | ConnectionConfig | PoolConfig);
   
-  query<T = any>(sql: string, params?: any[]): Promise<T[]>;
+  query<T = any>(sql: string, params?: any[], options?: QueryOptions): Promise<T[]>;
   connect(): Promise<PoolClient>;
+  metrics(): Metrics;
   end(): Promise<void>;
 }
 
-export interface PoolClient {
-  query<T = any>(sql: string, params?: any[]): Promise<T[]>;
-  release(): void;
+export class PoolClient {
+  query<T = any>(sql: string, params?: any[], options?: QueryOptions & { rowMode?: 'objects' }): Promise<T[]>;
+  query(sql: string, params: any[] | undefined, options: { rowMode: 'columnar' }): Promise<ColumnarResult>;
+  /** COMMIT, then release. */
+  commit(): Promise<void>;
+  /** ROLLBACK, then release. */
+  rollback(): Promise<void>;
+  /** Returns the connection to the pool; pass an error (or true) to close it instead. */
+  release(error?: Error | boolean): void;
 }
@@ -1,11 +1,371 @@
 const path = require('path');
+const { Readable, Writable } = require('stream');
 
+let Connection;
 try {
-    const { Connection } = require(path.join(__dirname, 'build', 'Release', 'pgnx.node'));
-    module.exports = { Connection };
+    ({ Connection } = require(path.join(__dirname, 'build', 'Release', 'pgnx.node')));
 } catch (error) {
     throw new Error(
         'Failed to load pgnx native addon. ' +
         'Please reinstall: npm install pgnx'
     );
 }
+
+// A stream the caller drops without finishing would otherwise hold its
+// pooled connection forever.
+const abandoned = new FinalizationRegistry(handle => handle.cancel());
+// Nobody knows what state a forgotten client's connection is in, so it is closed.
+const unreleased = new FinalizationRegistry(handle => handle.release(true));
+
+// Rows of a streamed query. Iterating yields rows; nextBatch() hands out the
+// underlying batches. The server is only read as fast as batches are taken.
+class QueryStream {
+    constructor(handle) {
+        this._handle = handle;
+        this._done = false;
+        abandoned.register(this, handle, this);
+    }
+
+    async nextBatch() {
+        if (this._done) return null;
+        try {
+            const batch = await this._handle.next();
+            if (batch === null) this._finish();
+            return batch;
+        } catch (error) {
+            this._finish();
+            throw error;
+        }
+    }
+
+    cancel() {
+        if (this._done) return;
+        this._finish();
+        this._handle.cancel();
+    }
+
+    _finish() {
+        this._done = true;
+        abandoned.unregister(this);
+    }
+
+    async *[Symbol.asyncIterator]() {
+        try {
+            let batch;
+            while ((batch = await this.nextBatch()) !== null) {
+                yield* batch;
+            }
+        } finally {
+            this.cancel();
+        }
+    }
+}
+
+// A client pinned to one pooled connection until release(), so BEGIN,
+// COMMIT and everything between them run on the same backend.
+class PoolClient {
+    constructor(handle) {
+        this._handle = handle;
+        this._released = false;
+        unreleased.register(this, handle, this);
+    }
+
+    query(sql, params, options) {
+        return this._handle.query(sql, params, options);
+    }
+
+    // End the transaction opened by Connection#begin() and release the client.
+    async commit() {
+        await this._finish('COMMIT');
+    }
+
+    async rollback() {
+        await this._finish('ROLLBACK');
+    }
+
+    async _finish(sql) {
+        try {
+            await this.query(sql);
+        } catch (error) {
+            this.release(error);
+            throw error;
+        }
+        this.release();
+    }
+
+    // Passing an error (or true) closes the connection instead of reusing it.
+    release(error) {
+        if (this._released) return;
+        this._released = true;
+        unreleased.unregister(this);
+        this._handle.release(Boolean(error));
+    }
+}
+
+// COPY ... FROM STDIN. Each chunk goes to libpq as-is; a write completes
+// once libpq has queued it, so a fast producer is held back by the socket.
+// `rowCount` is set when the stream finishes.
+class CopyFromStream extends Writable {
+    constructor(handle) {
+        super();
+        this._handle = handle;
+        this._ended = false;
+        this.rowCount = 0;
+        handle.done.catch(() => {});
+    }
+
+    _write(chunk, encoding, callback) {
+        this._handle.write(chunk).then(() => callback(), callback);
+    }
+
+    _final(callback) {
+        this._ended = true;
+        this._handle.end();
+        this._handle.done.then(result => {
+            this.rowCount = result.rowCount;
+            callback();
+        }, callback);
+    }
+
+    // Aborting sends CopyFail, which rolls the COPY back and keeps the connection.
+    _destroy(error, callback) {
+        if (!this._ended) {
+            this._ended = true;
+            this._handle.end(error ? error.message : 'COPY aborted by client');
+        }
+        callback(error);
+    }
+}
+
+// COPY ... TO STDOUT as a stream of raw Buffers. The server is only read as
+// fast as the stream is consumed.
+class CopyToStream extends Readable {
+    constructor(handle) {
+        super();
+        this._handle = handle;
+        handle.done.catch(() => {});
+    }
+
+    _read() {
+        this._handle.read().then(chunk => this.push(chunk), error => this.destroy(error));
+    }
+
+    _destroy(error, callback) {
+        this._handle.cancel();
+        callback(error);
+    }
+}
+
+const nativeStream = Connection.prototype.stream;
+Connection.prototype.stream = function stream(sql, params, options) {
+    return new QueryStream(nativeStream.call(this, sql, params, options));
+};
+
+const nativeConnect = Connection.prototype.connect;
+Connection.prototype.connect = async function connect() {
+    const handle = nativeConnect.call(this);
+    await handle.ready;
+    return new PoolClient(handle);
+};
+
+// Joins the columnar results of consecutive partitions: typed columns are
+// copied into one array each, and NULL flags are zero-filled for partitions
+// that had none.
+function mergeColumnar(parts) {
+    const rowCount = parts.reduce((total, part) => total + part.rowCount, 0);
+    const columns = {};
+    const nulls = {};
+    for (const name of Object.keys(parts[0].columns)) {
+        const first = parts[0].columns[name];
+        if (Array.isArray(first)) {
+            columns[name] = parts.flatMap(part => part.columns[name]);
+        } else {
+            columns[name] = new first.constructor(rowCount);
+        }
+        if (parts.some(part => part.nulls[name])) nulls[name] = new Uint8Array(rowCount);
+
+        let at = 0;
+        for (const part of parts) {
+            if (!Array.isArray(first)) columns[name].set(part.columns[name], at);
+            if (nulls[name] && part.nulls[name]) nulls[name].set(part.nulls[name], at);
+            at += part.rowCount;
+        }
+    }
+    return { rowCount, columns, nulls };
+}
+
+function quoteIdent(name) {
+    return '"' + String(name).replace(/"/g, '""') + '"';
+}
+
+// Runs `sql` once per range of `partitionBy` on its own pooled connection,
+// all inside one snapshot exported by the first, so the partitions see the
+// same data. Rows come back concatenated in range order, or as one columnar
+// result with `rowMode: 'columnar'`.
+Connection.prototype.parallelQuery = async function parallelQuery(sql, params, options) {
+    if (!Array.isArray(params) && params !== undefined) {
+        options = params;
+        params = [];
+    }
+    params = params ?? [];
+    const { partitionBy, ranges, concurrency, ...queryOptions } = options ?? {};
+    if (typeof partitionBy !== 'string' || !Array.isArray(ranges) || ranges.length === 0) {
+        throw new TypeError('parallelQuery needs a partitionBy column and a non-empty ranges array');
+    }
+    for (const range of ranges) {
+        if (!Array.isArray(range) || range.length !== 2) {
+            throw new TypeError('Each range must be a [low, high) pair');
+        }
+    }
+
+    // Range bounds follow the caller's parameters; a null bound is left out.
+    const column = quoteIdent(partitionBy);
+    const runRange = (client, index) => {
+        const values = [...params];
+        const bounds = [];
+        const [low, high] = ranges[index];
+        if (low !== null && low !== undefined) bounds.push(`${column} >= $${values.push(low)}`);
+        if (high !== null && high !== undefined) bounds.push(`${column} < $${values.push(high)}`);
+        const where = bounds.length ? ` WHERE ${bounds.join(' AND ')}` : '';
+        return client.query(`SELECT * FROM (${sql}) AS partitioned${where}`, values, queryOptions);
+    };
+
+    const results = new Array(ranges.length);
+    let next = 0;
+    let failed = false;
+    // Clients take the next free range until none are left or one fails.
+    const work = async client => {
+        try {
+            while (!failed && next < ranges.length) {
+                const index = next++;
+                results[index] = await runRange(client, index);
+            }
+        } catch (error) {
+            failed = true;
+            throw error;
+        }
+    };
+    const open = async client => {
+        await client.query('BEGIN ISOLATION LEVEL REPEATABLE READ READ ONLY');
+    };
+    const finish = async (client, error) => {
+        if (error) {
+            client.release(error);
+            throw error;
+        }
+        await client.query('COMMIT');
+        client.release();
+    };
+
+    const exporter = await this.connect();
+    let snapshot;
+    try {
+        await open(exporter);
+        [{ snapshot }] = await exporter.query('SELECT pg_export_snapshot() AS snapshot');
+    } catch (error) {
+        exporter.release(error);
+        throw error;
+    }
+
+    // The exporter keeps its transaction open until every other client that
+    // took on ranges has imported the snapshot, and works through ranges
+    // meanwhile. It counts as one of `concurrency` clients, and there are
+    // never more clients than the pool holds.
+    const { max } = this.poolStatus();
+    const helpers = Math.max(0, Math.min(ranges.length, concurrency ?? max, max) - 1);
+    const importing = [];
+    const helped = [];
+    for (let i = 0; i < helpers; i++) {
+        helped.push((async () => {
+            const client = await this.connect();
+            // Once every range is taken nobody will import the snapshot, so
+            // the exporter need not wait for clients still in the queue.
+            if (failed || next >= ranges.length) {
+                client.release();
+                return;
+            }
+            let error;
+            const imported = open(client)
+                .then(() => client.query(`SET TRANSACTION SNAPSHOT '${snapshot.replace(/'/g, "''")}'`));
+            importing.push(imported.catch(() => {}));
+            await imported.then(() => work(client)).catch(caught => {
+                failed = true;
+                error = caught;
+            });
+            await finish(client, error);
+        })().catch(error => {
+            failed = true;
+            throw error;
+        }));
+    }
+
+    const exported = (async () => {
+        let error;
+        await work(exporter).catch(caught => { error = caught; });
+        await Promise.all(importing);
+        await finish(exporter, error);
+    })();
+
+    const outcomes = await Promise.allSettled([exported, ...helped]);
+    const rejected = outcomes.find(outcome => outcome.status === 'rejected');
+    if (rejected) throw rejected.reason;
+    return queryOptions.rowMode === 'columnar' ? mergeColumnar(results) : results.flat();
+};
+
+// A transaction needs every statement on one backend, so begin() pins a
+// client and the transaction is ended through it.
+Connection.prototype.begin = async function begin() {
+    const client = await this.connect();
+    try {
+        await client.query('BEGIN');
+    } catch (error) {
+        client.release(error);
+        throw error;
+    }
+    return client;
+};
+
+Connection.prototype.commit = async function commit() {
+    throw new Error('commit() must be called on the client returned by begin() or connect()');
+};
+
+Connection.prototype.rollback = async function rollback() {
+    throw new Error('rollback() must be called on the client returned by begin() or connect()');
+};
+
+const nativeCopyFrom = Connection.prototype.copyFrom;
+Connection.prototype.copyFrom = function copyFrom(sql) {
+    return new CopyFromStream(nativeCopyFrom.call(this, sql));
+};
+
+const nativeCopyTo = Connection.prototype.copyTo;
+Connection.prototype.copyTo = function copyTo(sql) {
+    return new CopyToStream(nativeCopyTo.call(this, sql));
+};
+
+// pg-style entry point over a Connection's pool.
+class Pool {
+    constructor(config) {
+        if (typeof config === 'string') config = { connectionString: config };
+        const { connectionString, max, poolSize, ...options } = config;
+        this._connection = new Connection(connectionString, max ?? poolSize ?? 10, options);
+    }
+
+    query(sql, params, options) {
+        return this._connection.query(sql, params, options);
+    }
+
+    connect() {
+        return this._connection.connect();
+    }
+
+    metrics() {
+        return this._connection.metrics();
+    }
+
+    async end() {
+        this._connection.close();
+    }
+}
+
+module.exports = { Connection, Pool, PoolClient, QueryStream, CopyFromStream, CopyToStream };
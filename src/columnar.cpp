@@ -0,0 +1,231 @@
+#include "columnar.h"
+#include "convert.h"
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <vector>
+
+namespace {
+
+enum class ColumnKind { Values, Int16, Int32, Int64, Float32, Float64, Bool };
+
+ColumnKind KindOf(Oid type) {
+    switch (type) {
+        case INT2OID: return ColumnKind::Int16;
+        case INT4OID: return ColumnKind::Int32;
+        case INT8OID: return ColumnKind::Int64;
+        case FLOAT4OID: return ColumnKind::Float32;
+        case FLOAT8OID: return ColumnKind::Float64;
+        case BOOLOID: return ColumnKind::Bool;
+        default: return ColumnKind::Values;
+    }
+}
+
+size_t WidthOf(ColumnKind kind) {
+    switch (kind) {
+        case ColumnKind::Int16: return 2;
+        case ColumnKind::Int32:
+        case ColumnKind::Float32: return 4;
+        case ColumnKind::Int64:
+        case ColumnKind::Float64: return 8;
+        case ColumnKind::Bool: return 1;
+        default: return 0;
+    }
+}
+
+// Where a typed column (and its null flags, if any) lives in the shared buffer.
+struct ColumnLayout {
+    ColumnKind kind = ColumnKind::Values;
+    size_t offset = 0;
+    size_t nullOffset = 0;
+    bool hasNulls = false;
+};
+
+size_t Align8(size_t n) { return (n + 7) & ~size_t(7); }
+
+template <typename T>
+void Store(uint8_t* base, size_t offset, int row, T value) {
+    std::memcpy(base + offset + row * sizeof(T), &value, sizeof(T));
+}
+
+void DecodeCell(uint8_t* base, const ColumnLayout& col, int row, const char* value, bool binary) {
+    switch (col.kind) {
+        case ColumnKind::Int16:
+            Store<int16_t>(base, col.offset, row, binary ? static_cast<int16_t>(ReadU16(value))
+                                                         : static_cast<int16_t>(std::strtol(value, nullptr, 10)));
+            break;
+        case ColumnKind::Int32:
+            Store<int32_t>(base, col.offset, row, binary ? static_cast<int32_t>(ReadU32(value))
+                                                         : static_cast<int32_t>(std::strtol(value, nullptr, 10)));
+            break;
+        case ColumnKind::Int64:
+            Store<int64_t>(base, col.offset, row, binary ? static_cast<int64_t>(ReadU64(value))
+                                                         : static_cast<int64_t>(std::strtoll(value, nullptr, 10)));
+            break;
+        case ColumnKind::Float32: {
+            float f;
+            if (binary) {
+                uint32_t bits = ReadU32(value);
+                std::memcpy(&f, &bits, sizeof(f));
+            } else {
+                f = std::strtof(value, nullptr);
+            }
+            Store<float>(base, col.offset, row, f);
+            break;
+        }
+        case ColumnKind::Float64: {
+            double d;
+            if (binary) {
+                uint64_t bits = ReadU64(value);
+                std::memcpy(&d, &bits, sizeof(d));
+            } else {
+                d = std::strtod(value, nullptr);
+            }
+            Store<double>(base, col.offset, row, d);
+            break;
+        }
+        case ColumnKind::Bool:
+            base[col.offset + row] = binary ? value[0] != 0 : value[0] == 't';
+            break;
+        default:
+            break;
+    }
+}
+
+void StoreNull(uint8_t* base, const ColumnLayout& col, int row) {
+    base[col.nullOffset + row] = 1;
+    if (col.kind == ColumnKind::Float32) Store<float>(base, col.offset, row, std::numeric_limits<float>::quiet_NaN());
+    if (col.kind == ColumnKind::Float64) Store<double>(base, col.offset, row, std::numeric_limits<double>::quiet_NaN());
+}
+
+class ColumnarWorker : public Napi::AsyncWorker {
+public:
+    ColumnarWorker(Napi::Env env, Napi::Promise::Deferred deferred, PGresult* result, Decoded decoded)
+        : Napi::AsyncWorker(env, "pgnx:columnar"), deferred_(deferred), result_(result), decoded_(std::move(decoded)) {}
+
+    ~ColumnarWorker() override {
+        std::free(data_);
+        PQclear(result_);
+    }
+
+    void Execute() override {
+        rows_ = PQntuples(result_);
+        int cols = PQnfields(result_);
+        layout_.resize(cols);
+
+        size_t total = 0;
+        for (int j = 0; j < cols; ++j) {
+            auto& col = layout_[j];
+            col.kind = KindOf(PQftype(result_, j));
+            if (col.kind == ColumnKind::Values) continue;
+
+            col.offset = total;
+            total = Align8(total + WidthOf(col.kind) * rows_);
+            for (int i = 0; i < rows_ && !col.hasNulls; ++i) col.hasNulls = PQgetisnull(result_, i, j);
+            if (col.hasNulls) {
+                col.nullOffset = total;
+                total = Align8(total + rows_);
+            }
+        }
+
+        // Never zero, so the ArrayBuffer always owns a real allocation.
+        size_ = total > 0 ? total : 8;
+        data_ = static_cast<uint8_t*>(std::calloc(size_, 1));
+        if (!data_) {
+            SetError("Out of memory for columnar result");
+            return;
+        }
+
+        for (int j = 0; j < cols; ++j) {
+            const auto& col = layout_[j];
+            if (col.kind == ColumnKind::Values) continue;
+            bool binary = PQfformat(result_, j) == 1;
+            for (int i = 0; i < rows_; ++i) {
+                if (col.hasNulls && PQgetisnull(result_, i, j)) {
+                    StoreNull(data_, col, i);
+                } else {
+                    DecodeCell(data_, col, i, PQgetvalue(result_, i, j), binary);
+                }
+            }
+        }
+    }
+
+    void OnOK() override {
+        auto start = std::chrono::steady_clock::now();
+        auto env = Env();
+        // The block is handed over as is where external buffers are allowed,
+        // and copied where they aren't. Until then it is still ours to free.
+        auto buffer = Napi::ArrayBuffer::New(env, data_, size_, [](Napi::Env, void* data) { std::free(data); });
+        if (env.IsExceptionPending()) {
+            env.GetAndClearPendingException();
+            buffer = Napi::ArrayBuffer::New(env, size_);
+            if (env.IsExceptionPending()) {
+                deferred_.Reject(env.GetAndClearPendingException().Value());
+                if (decoded_) decoded_({});
+                return;
+            }
+            std::memcpy(buffer.Data(), data_, size_);
+        } else {
+            data_ = nullptr;
+        }
+
+        auto columns = Napi::Object::New(env);
+        auto nulls = Napi::Object::New(env);
+        for (int j = 0; j < static_cast<int>(layout_.size()); ++j) {
+            const auto& col = layout_[j];
+            auto name = Napi::String::New(env, PQfname(result_, j));
+            columns.Set(name, ColumnValue(env, buffer, col, j));
+            if (col.hasNulls) {
+                nulls.Set(name, Napi::Uint8Array::New(env, rows_, buffer, col.nullOffset, napi_uint8_array));
+            }
+        }
+
+        auto out = Napi::Object::New(env);
+        out.Set("rowCount", Napi::Number::New(env, rows_));
+        out.Set("columns", columns);
+        out.Set("nulls", nulls);
+        deferred_.Resolve(out);
+        if (decoded_) decoded_(std::chrono::steady_clock::now() - start);
+    }
+
+    void OnError(const Napi::Error& error) override {
+        deferred_.Reject(error.Value());
+        if (decoded_) decoded_({});
+    }
+
+private:
+    Napi::Value ColumnValue(Napi::Env env, const Napi::ArrayBuffer& buffer, const ColumnLayout& col, int j) {
+        switch (col.kind) {
+            case ColumnKind::Int16: return Napi::Int16Array::New(env, rows_, buffer, col.offset, napi_int16_array);
+            case ColumnKind::Int32: return Napi::Int32Array::New(env, rows_, buffer, col.offset, napi_int32_array);
+            case ColumnKind::Int64: return Napi::BigInt64Array::New(env, rows_, buffer, col.offset, napi_bigint64_array);
+            case ColumnKind::Float32: return Napi::Float32Array::New(env, rows_, buffer, col.offset, napi_float32_array);
+            case ColumnKind::Float64: return Napi::Float64Array::New(env, rows_, buffer, col.offset, napi_float64_array);
+            case ColumnKind::Bool: return Napi::Uint8Array::New(env, rows_, buffer, col.offset, napi_uint8_array);
+            default: break;
+        }
+
+        auto values = Napi::Array::New(env, rows_);
+        Oid type = PQftype(result_, j);
+        for (int i = 0; i < rows_; ++i) values[i] = FastConvert(env, result_, i, j, type);
+        return values;
+    }
+
+    Napi::Promise::Deferred deferred_;
+    PGresult* result_;
+    std::vector<ColumnLayout> layout_;
+    int rows_ = 0;
+    uint8_t* data_ = nullptr;
+    size_t size_ = 0;
+    Decoded decoded_;
+};
+
+}  // namespace
+
+void ResolveColumnar(Napi::Env env, Napi::Promise::Deferred deferred, PGresult* result, Decoded decoded) {
+    if (!result) result = PQmakeEmptyPGresult(nullptr, PGRES_TUPLES_OK);
+    (new ColumnarWorker(env, deferred, result, std::move(decoded)))->Queue();
+}
@@ -0,0 +1,11 @@
+#pragma once
+#include <napi.h>
+#include <libpq-fe.h>
+#include "convert.h"
+
+// Resolves `deferred` with `{ rowCount, columns, nulls }`, one array per
+// column keyed by name. int2/int4/int8/float4/float8/bool columns become typed
+// arrays over a single ArrayBuffer that a worker thread fills; other columns
+// are arrays of converted values. `nulls` holds a Uint8Array (1 = NULL) for
+// each typed column that contains NULLs. Takes ownership of `result`.
+void ResolveColumnar(Napi::Env env, Napi::Promise::Deferred deferred, PGresult* result, Decoded decoded = nullptr);
@@ -1,230 +1,326 @@
 #include "connection.h"
+#include "convert.h"
+#include <algorithm>
+#include <climits>
+#include <cmath>
 #include <thread>
 
-inline Napi::Value FastConvert(Napi::Env env, const pqxx::field& field, int type) {
-    if (field.is_null()) return env.Null();
-    
-    if (type == 23 || type == 20 || type == 21) {
-        return Napi::Number::New(env, field.as<long long>());
-    } else if (type == 16) {
-        return Napi::Boolean::New(env, field.as<bool>());
-    } else if (type == 700 || type == 701) {
-        return Napi::Number::New(env, field.as<double>());
-    }
-    return Napi::String::New(env, field.c_str(), field.size());
+Napi::Object Connection::Init(Napi::Env env, Napi::Object exports) {
+    auto func = DefineClass(env, "Connection", {
+        InstanceMethod("query", &Connection::Query),
+        InstanceMethod("querySync", &Connection::QuerySync),
+        InstanceMethod("prepare", &Connection::Prepare),
+        InstanceMethod("execute", &Connection::Execute),
+        InstanceMethod("pipeline", &Connection::Pipeline),
+        InstanceMethod("stream", &Connection::Stream),
+        InstanceMethod("copyFrom", &Connection::CopyFrom),
+        InstanceMethod("copyTo", &Connection::CopyTo),
+        InstanceMethod("connect", &Connection::Connect),
+        InstanceMethod("listen", &Connection::Listen),
+        InstanceMethod("unlisten", &Connection::Unlisten),
+        InstanceMethod("poolStatus", &Connection::PoolStatus),
+        InstanceMethod("metrics", &Connection::Metrics),
+        InstanceMethod("close", &Connection::Close)
+    });
+    auto* constructor = new Napi::FunctionReference();
+    *constructor = Napi::Persistent(func);
+    env.SetInstanceData(constructor);
+    exports.Set("Connection", func);
+    return exports;
 }
 
-inline Napi::Array ConvertResult(Napi::Env env, const pqxx::result& result) {
-    size_t rowCount = result.size();
-    auto rows = Napi::Array::New(env, rowCount);
-    
-    if (rowCount == 0) return rows;
-    
-    size_t colCount = result.columns();
+Connection::Connection(const Napi::CallbackInfo& info) : Napi::ObjectWrap<Connection>(info) {
+    connStr_ = info[0].As<Napi::String>().Utf8Value();
+    size_t poolSize = info.Length() > 1 ? info[1].As<Napi::Number>().Uint32Value() : 10;
     
-    for (size_t i = 0; i < rowCount; ++i) {
-        auto row = Napi::Object::New(env);
+    EngineOptions options;
+    PoolOptions poolOptions;
+    std::string cacheChannel;
+    std::vector<std::string> replicaConnStrs;
+    Balance balance = Balance::LeastOutstanding;
+    if (info.Length() > 2 && info[2].IsObject()) {
+        auto opts = info[2].As<Napi::Object>();
+        sharedPool_ = opts.Get("sharedPool").ToBoolean().Value();
+        auto replicas = opts.Get("replicas");
+        if (replicas.IsArray()) {
+            auto list = replicas.As<Napi::Array>();
+            for (uint32_t i = 0; i < list.Length(); ++i) replicaConnStrs.push_back(list.Get(i).ToString().Utf8Value());
+        }
+        auto balanceMode = opts.Get("balance");
+        std::string mode = balanceMode.IsString() ? balanceMode.As<Napi::String>().Utf8Value() : "leastOutstanding";
+        if (mode == "latency") {
+            balance = Balance::Latency;
+        } else if (mode != "leastOutstanding") {
+            // Nothing is open yet, so there is nothing to close either.
+            detached_ = true;
+            Napi::TypeError::New(info.Env(), "balance must be 'leastOutstanding' or 'latency'").ThrowAsJavaScriptException();
+            return;
+        }
+        auto cacheSize = opts.Get("statementCacheSize");
+        if (cacheSize.IsNumber()) options.statementCacheSize = cacheSize.As<Napi::Number>().Uint32Value();
+        options.autoBatch = opts.Get("autoBatch").ToBoolean().Value();
+        auto window = opts.Get("batchWindowMicros");
+        if (window.IsNumber()) options.batchWindowMicros = window.As<Napi::Number>().Uint32Value();
+        binary_ = opts.Get("binary").ToBoolean().Value();
+        auto millis = [&](const char* key, std::chrono::milliseconds& out) {
+            auto value = opts.Get(key);
+            if (value.IsNumber()) out = std::chrono::milliseconds(value.As<Napi::Number>().Uint32Value());
+        };
+        millis("connectionTimeoutMillis", poolOptions.connectionTimeout);
+        millis("idleTimeoutMillis", poolOptions.idleTimeout);
+        millis("maxLifetimeMillis", poolOptions.maxLifetime);
+        millis("maxQueueWaitMillis", poolOptions.maxQueueWait);
+        auto count = [&](const char* key, size_t& out) {
+            auto value = opts.Get(key);
+            if (value.IsNumber()) out = value.As<Napi::Number>().Uint32Value();
+        };
+        count("min", poolOptions.min);
+        count("reservedInteractive", poolOptions.reservedInteractive);
+        count("reservedBatch", poolOptions.reservedBatch);
+        count("maxBatch", poolOptions.maxBatch);
+        count("maxQueue", poolOptions.maxQueue);
         
-        for (size_t j = 0; j < colCount; ++j) {
-            row.Set(result.column_name(j), FastConvert(env, result[i][j], result.column_type(j)));
+        auto cache = opts.Get("cache");
+        if (cache.ToBoolean().Value()) {
+            options.cacheMaxBytes = 16 * 1024 * 1024;
+            if (cache.IsObject()) {
+                auto cacheOpts = cache.As<Napi::Object>();
+                auto maxBytes = cacheOpts.Get("maxBytes");
+                if (!maxBytes.IsUndefined()) {
+                    double bytes = maxBytes.IsNumber() ? maxBytes.As<Napi::Number>().DoubleValue() : 0;
+                    // Cast as is, a negative size would leave the cache unbounded.
+                    if (!std::isfinite(bytes) || bytes < 1) {
+                        detached_ = true;
+                        Napi::TypeError::New(info.Env(), "cache.maxBytes must be a positive number").ThrowAsJavaScriptException();
+                        return;
+                    }
+                    options.cacheMaxBytes = static_cast<size_t>(bytes);
+                }
+                auto ttl = cacheOpts.Get("ttlMillis");
+                if (ttl.IsNumber()) options.cacheTtl = std::chrono::milliseconds(ttl.As<Napi::Number>().Uint32Value());
+                auto channel = cacheOpts.Get("channel");
+                if (channel.IsString()) cacheChannel = channel.As<Napi::String>().Utf8Value();
+            }
         }
-        rows[i] = row;
     }
-    return rows;
-}
-
-struct QueryWorker : Napi::AsyncWorker {
-    std::shared_ptr<ConnectionPool> pool;
-    std::string sql;
-    std::vector<std::string> params;
-    pqxx::result result;
-    Napi::Promise::Deferred deferred;
-    std::shared_ptr<pqxx::connection> conn;
-    std::string errorMsg;
-    
-    QueryWorker(Napi::Env env, std::shared_ptr<ConnectionPool> p, std::string s, std::vector<std::string> prm, Napi::Promise::Deferred d)
-        : AsyncWorker(env), pool(p), sql(std::move(s)), params(std::move(prm)), deferred(d) {}
     
-    void Execute() override {
-        conn = pool->acquire();
-        if (!conn) {
-            errorMsg = "Failed to acquire connection from pool";
-            return;
+    if (sharedPool_) {
+        pool_ = AcquireSharedPool(connStr_, poolSize, poolOptions);
+        // A worker thread that exits with queries in flight would otherwise
+        // keep their connections out of the shared pool for good.
+        napi_add_env_cleanup_hook(info.Env(), &Connection::OnEnvCleanup, this);
+    } else {
+        pool_ = std::make_shared<ConnectionPool>(connStr_, poolSize, poolOptions);
+    }
+    // Each replica gets a pool of the same size and settings as the primary's.
+    if (!replicaConnStrs.empty()) {
+        replicas_ = std::make_shared<ReplicaSet>(balance);
+        for (const auto& replica : replicaConnStrs) {
+            replicas_->add(replica, sharedPool_ ? AcquireSharedPool(replica, poolSize, poolOptions)
+                                                : std::make_shared<ConnectionPool>(replica, poolSize, poolOptions));
         }
-        try {
-            pqxx::nontransaction txn(*conn);
-            result = params.empty() ? txn.exec(sql) : txn.exec_params(sql, pqxx::prepare::make_dynamic_params(params));
-        } catch (const std::exception& e) {
-            errorMsg = e.what();
-            throw;
+    }
+    engine_ = std::make_shared<QueryEngine>(info.Env(), pool_, options, replicas_);
+
+    if (info.Length() > 2 && info[2].IsObject()) {
+        auto opts = info[2].As<Napi::Object>();
+        auto hook = opts.Get("onSlowQuery");
+        if (hook.IsFunction()) {
+            auto threshold = opts.Get("slowQueryMillis");
+            engine_->onSlowQuery(std::chrono::milliseconds(threshold.IsNumber() ? threshold.As<Napi::Number>().Uint32Value() : 1000),
+                                 hook.As<Napi::Function>());
         }
     }
     
-    void OnOK() override {
-        if (conn) pool->release(conn);
-        if (!errorMsg.empty()) {
-            deferred.Reject(Napi::Error::New(Env(), errorMsg).Value());
+    if (!cacheChannel.empty() && engine_->cache()) {
+        listener_ = std::make_unique<Listener>(info.Env(), connStr_);
+        std::weak_ptr<QueryEngine> engine = engine_;
+        // Invalidations sent while the listener was disconnected are lost,
+        // so every entry goes once it is back.
+        listener_->subscribe(cacheChannel, [engine](const Listener::Notification& note) {
+            if (auto live = engine.lock()) live->invalidate(note.payload);
+        }, [engine] {
+            if (auto live = engine.lock()) live->invalidate("*");
+        });
+    }
+}
+
+Connection::~Connection() {
+    if (listener_) listener_->stop();
+    if (sharedPool_) napi_remove_env_cleanup_hook(Env(), &Connection::OnEnvCleanup, this);
+    detachPool();
+}
+
+void Connection::OnEnvCleanup(void* arg) {
+    auto* self = static_cast<Connection*>(arg);
+    if (self->listener_) self->listener_->stop();
+    self->engine_->teardown();
+    self->detachPool();
+}
+
+// A shared pool stays open for its other holders.
+void Connection::detachPool() {
+    if (detached_) return;
+    detached_ = true;
+    std::vector<std::shared_ptr<ConnectionPool>> pools{pool_};
+    if (replicas_) {
+        for (const auto& host : replicas_->hosts()) pools.push_back(host.pool);
+    }
+    for (const auto& pool : pools) {
+        if (sharedPool_) {
+            ReleaseSharedPool(pool);
         } else {
-            deferred.Resolve(ConvertResult(Env(), result));
+            pool->close();
         }
     }
+}
+
+Napi::Value Connection::QuerySync(const Napi::CallbackInfo& info) {
+    auto env = info.Env();
     
-    void OnError(const Napi::Error& e) override {
-        if (conn) pool->release(conn);
-        deferred.Reject(e.Value());
+    // Queued behind async queries that can only finish once the event loop
+    // runs again, a blocking wait here could never end.
+    auto conn = pool_->acquire(false);
+    if (!conn) {
+        Napi::Error::New(env, "Failed to acquire connection").ThrowAsJavaScriptException();
+        return env.Undefined();
     }
-};
-
-struct PipelineWorker : Napi::AsyncWorker {
-    std::shared_ptr<ConnectionPool> pool;
-    std::vector<std::string> queries;
-    std::vector<size_t> affected;
-    Napi::Promise::Deferred deferred;
-    std::shared_ptr<pqxx::connection> conn;
-    std::string errorMsg;
     
-    PipelineWorker(Napi::Env env, std::shared_ptr<ConnectionPool> p, std::vector<std::string> q, Napi::Promise::Deferred d)
-        : AsyncWorker(env), pool(p), queries(std::move(q)), deferred(d) {}
+    std::string sql = info[0].As<Napi::String>().Utf8Value();
+    auto params = ReadParams(info[1], binary_);
     
-    void Execute() override {
-        conn = pool->acquire();
-        if (!conn) {
-            errorMsg = "Failed to acquire connection from pool";
-            return;
-        }
-        
-        try {
-            pqxx::nontransaction txn(*conn);
-            affected.reserve(queries.size());
-            for (const auto& sql : queries) {
-                affected.push_back(txn.exec(sql).affected_rows());
-            }
-        } catch (const std::exception& e) {
-            errorMsg = e.what();
-            throw;
-        }
+    PGresult* result;
+    if (params.empty() && !binary_) {
+        result = PQexec(conn->raw, sql.c_str());
+    } else {
+        auto values = params.pointers();
+        auto lengths = params.lengths();
+        result = PQexecParams(conn->raw, sql.c_str(), params.size(), params.typeData(), values.data(),
+                              lengths.data(), params.formatData(), binary_ ? 1 : 0);
     }
     
-    void OnOK() override {
-        if (conn) pool->release(conn);
-        
-        if (!errorMsg.empty()) {
-            deferred.Reject(Napi::Error::New(Env(), errorMsg).Value());
-            return;
-        }
-        
-        auto env = Env();
-        auto results = Napi::Array::New(env, affected.size());
-        for (size_t i = 0; i < affected.size(); ++i) {
-            results[i] = Napi::Number::New(env, affected[i]);
-        }
-        deferred.Resolve(results);
+    auto status = PQresultStatus(result);
+    if (status != PGRES_TUPLES_OK && status != PGRES_COMMAND_OK && status != PGRES_EMPTY_QUERY) {
+        std::string error = result ? ResultError(result) : ConnectionError(conn->raw);
+        PQclear(result);
+        pool_->release(conn);
+        Napi::Error::New(env, error).ThrowAsJavaScriptException();
+        return env.Undefined();
     }
     
-    void OnError(const Napi::Error& e) override {
-        if (conn) pool->release(conn);
-        deferred.Reject(e.Value());
+    auto rows = ConvertResult(env, result);
+    PQclear(result);
+    // A transaction left open here would leak into whoever gets the
+    // connection next.
+    if (PQtransactionStatus(conn->raw) == PQTRANS_IDLE) {
+        pool_->release(conn);
+    } else {
+        pool_->discard(conn);
     }
-};
+    return rows;
+}
 
-Napi::Object Connection::Init(Napi::Env env, Napi::Object exports) {
-    auto func = DefineClass(env, "Connection", {
-        InstanceMethod("query", &Connection::Query),
-        InstanceMethod("querySync", &Connection::QuerySync),
-        InstanceMethod("prepare", &Connection::Prepare),
-        InstanceMethod("execute", &Connection::Execute),
-        InstanceMethod("pipeline", &Connection::Pipeline),
-        InstanceMethod("begin", &Connection::Begin),
-        InstanceMethod("commit", &Connection::Commit),
-        InstanceMethod("rollback", &Connection::Rollback),
-        InstanceMethod("listen", &Connection::Listen),
-        InstanceMethod("unlisten", &Connection::Unlisten),
-        InstanceMethod("poolStatus", &Connection::PoolStatus),
-        InstanceMethod("close", &Connection::Close)
-    });
-    auto* constructor = new Napi::FunctionReference();
-    *constructor = Napi::Persistent(func);
-    env.SetInstanceData(constructor);
-    exports.Set("Connection", func);
-    return exports;
+// `{ timeoutMs, signal }` of query options; nullptr when neither is set.
+static std::shared_ptr<Cancel> ReadCancel(const Napi::Value& options) {
+    if (!options.IsObject()) return nullptr;
+    auto opts = options.As<Napi::Object>();
+    auto timeout = opts.Get("timeoutMs");
+    auto signal = opts.Get("signal");
+    bool timed = timeout.IsNumber() && timeout.As<Napi::Number>().DoubleValue() > 0;
+    if (!timed && !signal.IsObject()) return nullptr;
+
+    auto cancel = std::make_shared<Cancel>();
+    if (timed) cancel->timeout = std::chrono::milliseconds(timeout.As<Napi::Number>().Int64Value());
+    if (signal.IsObject()) cancel->signal = Napi::Persistent(signal.As<Napi::Object>());
+    return cancel;
 }
 
-Connection::Connection(const Napi::CallbackInfo& info) : Napi::ObjectWrap<Connection>(info) {
-    std::string connStr = info[0].As<Napi::String>().Utf8Value();
-    size_t poolSize = info.Length() > 1 ? info[1].As<Napi::Number>().Uint32Value() : 10;
-    pool_ = std::make_shared<ConnectionPool>(connStr, poolSize);
+// `{ readOnly }` of query options: the query may run on a replica.
+static bool ReadOnly(const Napi::Value& options) {
+    return options.IsObject() && options.As<Napi::Object>().Get("readOnly").ToBoolean().Value();
 }
 
-Connection::~Connection() {
-    for (auto& [_, listener] : listeners_) listener->stop();
-    pool_->close();
+// `{ priority }` of query options; false once a JS exception is pending.
+static bool ReadPriority(const Napi::Value& options, Priority& priority) {
+    if (!options.IsObject()) return true;
+    auto value = options.As<Napi::Object>().Get("priority");
+    if (value.IsUndefined()) return true;
+    std::string name = value.IsString() ? value.As<Napi::String>().Utf8Value() : "";
+    if (name == "interactive" || name == "batch") {
+        priority = name == "batch" ? Priority::Batch : Priority::Interactive;
+        return true;
+    }
+    Napi::TypeError::New(options.Env(), "priority must be 'interactive' or 'batch'").ThrowAsJavaScriptException();
+    return false;
 }
 
-Napi::Value Connection::QuerySync(const Napi::CallbackInfo& info) {
+// `{ buffers }` of query options: true for every column that would be a
+// string or raw bytes, or a list of column names. False once a JS exception
+// is pending.
+static bool ReadBuffers(const Napi::Value& options, std::unique_ptr<BufferColumns>& buffers) {
+    if (!options.IsObject()) return true;
+    auto value = options.As<Napi::Object>().Get("buffers");
+    if (value.IsUndefined() || (value.IsBoolean() && !value.As<Napi::Boolean>().Value())) return true;
+    if (value.IsBoolean()) {
+        buffers = std::make_unique<BufferColumns>();
+        buffers->all = true;
+        return true;
+    }
+    if (value.IsArray()) {
+        auto list = value.As<Napi::Array>();
+        buffers = std::make_unique<BufferColumns>();
+        for (uint32_t i = 0; i < list.Length(); ++i) buffers->names.push_back(list.Get(i).ToString().Utf8Value());
+        return true;
+    }
+    Napi::TypeError::New(options.Env(), "buffers must be a boolean or an array of column names").ThrowAsJavaScriptException();
+    return false;
+}
+
+// query(sql, params, options) as an op; nullptr once a JS exception is pending.
+static std::unique_ptr<QueryOp> ReadQuery(const Napi::CallbackInfo& info, bool binary) {
     auto env = info.Env();
-    
-    try {
-        auto conn = pool_->acquire();
-        if (!conn) {
-            Napi::Error::New(env, "Failed to acquire connection").ThrowAsJavaScriptException();
-            return env.Undefined();
+    auto op = std::make_unique<QueryOp>(env);
+    op->binary = binary;
+    if (info[2].IsObject()) {
+        auto rowMode = info[2].As<Napi::Object>().Get("rowMode");
+        std::string mode = rowMode.IsString() ? rowMode.As<Napi::String>().Utf8Value() : "objects";
+        if (mode == "columnar") {
+            op->rowMode = RowMode::Columnar;
+        } else if (mode != "objects") {
+            Napi::TypeError::New(env, "rowMode must be 'objects' or 'columnar'").ThrowAsJavaScriptException();
+            return nullptr;
         }
-        
-        std::vector<std::string> params;
-        if (info.Length() > 1 && info[1].IsArray()) {
-            auto arr = info[1].As<Napi::Array>();
-            uint32_t len = arr.Length();
-            params.reserve(len);
-            for (uint32_t i = 0; i < len; ++i) {
-                auto val = arr.Get(i);
-                if (val.IsString()) {
-                    params.emplace_back(val.As<Napi::String>().Utf8Value());
-                } else if (val.IsNumber()) {
-                    params.emplace_back(std::to_string(val.As<Napi::Number>().Int64Value()));
-                } else if (val.IsBoolean()) {
-                    params.emplace_back(val.As<Napi::Boolean>().Value() ? "true" : "false");
+    }
+    if (info[2].IsObject()) {
+        auto cache = info[2].As<Napi::Object>().Get("cache");
+        if (cache.ToBoolean().Value()) {
+            op->cache = std::make_unique<CachePolicy>();
+            if (cache.IsObject()) {
+                auto cacheOpts = cache.As<Napi::Object>();
+                auto ttl = cacheOpts.Get("ttlMillis");
+                if (ttl.IsNumber()) op->cache->ttl = std::chrono::milliseconds(ttl.As<Napi::Number>().Uint32Value());
+                auto tags = cacheOpts.Get("tags");
+                if (tags.IsArray()) {
+                    auto list = tags.As<Napi::Array>();
+                    for (uint32_t i = 0; i < list.Length(); ++i) op->cache->tags.push_back(list.Get(i).ToString().Utf8Value());
                 }
             }
         }
-        
-        pqxx::nontransaction txn(*conn);
-        auto result = params.empty() ? 
-            txn.exec(info[0].As<Napi::String>().Utf8Value()) : 
-            txn.exec_params(info[0].As<Napi::String>().Utf8Value(), pqxx::prepare::make_dynamic_params(params));
-        
-        pool_->release(conn);
-        return ConvertResult(env, result);
-        
-    } catch (const std::exception& e) {
-        Napi::Error::New(env, e.what()).ThrowAsJavaScriptException();
-        return env.Undefined();
     }
+    op->cancel = ReadCancel(info[2]);
+    op->readOnly = ReadOnly(info[2]);
+    if (!ReadPriority(info[2], op->priority)) return nullptr;
+    if (!ReadBuffers(info[2], op->buffers)) return nullptr;
+    Statement stmt{info[0].As<Napi::String>().Utf8Value(), ReadParams(info[1], binary)};
+    if (!stmt.params.empty()) stmt.prepare = PrepareMode::Auto;
+    op->statements.push_back(std::move(stmt));
+    return op;
 }
 
 Napi::Value Connection::Query(const Napi::CallbackInfo& info) {
-    auto env = info.Env();
-    auto deferred = Napi::Promise::Deferred::New(env);
-    
-    std::vector<std::string> params;
-    if (info.Length() > 1 && info[1].IsArray()) {
-        auto arr = info[1].As<Napi::Array>();
-        uint32_t len = arr.Length();
-        params.reserve(len);
-        for (uint32_t i = 0; i < len; ++i) {
-            auto val = arr.Get(i);
-            if (val.IsString()) {
-                params.emplace_back(val.As<Napi::String>().Utf8Value());
-            } else if (val.IsNumber()) {
-                params.emplace_back(std::to_string(val.As<Napi::Number>().Int64Value()));
-            } else if (val.IsBoolean()) {
-                params.emplace_back(val.As<Napi::Boolean>().Value() ? "true" : "false");
-            }
-        }
-    }
-    
-    auto* worker = new QueryWorker(env, pool_, info[0].As<Napi::String>().Utf8Value(), std::move(params), deferred);
-    worker->Queue();
-    return deferred.Promise();
+    auto op = ReadQuery(info, binary_);
+    if (!op) return info.Env().Undefined();
+    return engine_->submit(std::move(op));
 }
 
 Napi::Value Connection::Prepare(const Napi::CallbackInfo& info) {
@@ -241,105 +337,176 @@ Napi::Value Connection::Execute(const Napi::CallbackInfo& info) {
         return env.Undefined();
     }
     
-    auto deferred = Napi::Promise::Deferred::New(env);
-    std::vector<std::string> params;
-    if (info.Length() > 1 && info[1].IsArray()) {
-        auto arr = info[1].As<Napi::Array>();
-        uint32_t len = arr.Length();
-        params.reserve(len);
-        for (uint32_t i = 0; i < len; ++i) {
-            auto val = arr.Get(i);
-            if (val.IsString()) {
-                params.emplace_back(val.As<Napi::String>().Utf8Value());
-            } else if (val.IsNumber()) {
-                params.emplace_back(std::to_string(val.As<Napi::Number>().Int64Value()));
-            }
-        }
-    }
-    
-    auto* worker = new QueryWorker(env, pool_, it->second, std::move(params), deferred);
-    worker->Queue();
-    return deferred.Promise();
+    auto op = std::make_unique<QueryOp>(env);
+    op->binary = binary_;
+    op->cancel = ReadCancel(info[2]);
+    op->readOnly = ReadOnly(info[2]);
+    if (!ReadPriority(info[2], op->priority)) return env.Undefined();
+    if (!ReadBuffers(info[2], op->buffers)) return env.Undefined();
+    op->statements.push_back({it->second, ReadParams(info[1], binary_), PrepareMode::Pinned});
+    return engine_->submit(std::move(op));
 }
 
 Napi::Value Connection::Pipeline(const Napi::CallbackInfo& info) {
     auto env = info.Env();
-    auto deferred = Napi::Promise::Deferred::New(env);
     auto queries = info[0].As<Napi::Array>();
     
-    std::vector<std::string> queryList;
+    auto op = std::make_unique<QueryOp>(env);
+    op->pipeline = true;
+    op->binary = binary_;
+    if (info.Length() > 1 && info[1].IsObject()) {
+        auto mode = info[1].As<Napi::Object>().Get("mode");
+        op->isolate = mode.IsString() && mode.As<Napi::String>().Utf8Value() == "isolate";
+        op->cancel = ReadCancel(info[1]);
+        op->readOnly = ReadOnly(info[1]);
+        if (!ReadPriority(info[1], op->priority)) return env.Undefined();
+    }
+    
     uint32_t len = queries.Length();
-    queryList.reserve(len);
+    op->statements.reserve(len);
     for (uint32_t i = 0; i < len; ++i) {
-        queryList.emplace_back(queries.Get(i).As<Napi::String>().Utf8Value());
+        auto entry = queries.Get(i);
+        if (entry.IsString()) {
+            op->statements.push_back({entry.As<Napi::String>().Utf8Value(), {}});
+        } else if (entry.IsObject()) {
+            auto obj = entry.As<Napi::Object>();
+            op->statements.push_back({obj.Get("text").As<Napi::String>().Utf8Value(), ReadParams(obj.Get("values"), binary_)});
+        } else {
+            Napi::TypeError::New(env, "Pipeline entries must be SQL strings or { text, values } objects").ThrowAsJavaScriptException();
+            return env.Undefined();
+        }
     }
     
-    auto* worker = new PipelineWorker(env, pool_, std::move(queryList), deferred);
-    worker->Queue();
-    return deferred.Promise();
+    return engine_->submit(std::move(op));
 }
 
-Napi::Value Connection::Begin(const Napi::CallbackInfo& info) {
+// Returns the native half of a stream, `{ next, cancel }`; index.js wraps it
+// in an async iterator.
+Napi::Value Connection::Stream(const Napi::CallbackInfo& info) {
     auto env = info.Env();
-    auto deferred = Napi::Promise::Deferred::New(env);
-    auto* worker = new QueryWorker(env, pool_, "BEGIN", {}, deferred);
-    worker->Queue();
-    return deferred.Promise();
+    size_t batchSize = 1000;
+    if (info[2].IsObject()) {
+        auto size = info[2].As<Napi::Object>().Get("batchSize");
+        if (size.IsNumber()) {
+            batchSize = std::min<size_t>(std::max<uint32_t>(1, size.As<Napi::Number>().Uint32Value()), INT_MAX);
+        }
+    }
+
+    auto stream = std::make_shared<RowStream>(batchSize);
+    auto op = std::make_unique<QueryOp>(env);
+    op->binary = binary_;
+    op->readOnly = ReadOnly(info[2]);
+    if (!ReadPriority(info[2], op->priority)) return env.Undefined();
+    op->stream = stream;
+    op->statements.push_back({info[0].As<Napi::String>().Utf8Value(), ReadParams(info[1], binary_)});
+    engine_->submit(std::move(op));
+
+    auto engine = engine_;
+    auto handle = Napi::Object::New(env);
+    handle.Set("next", Napi::Function::New(env, [engine, stream](const Napi::CallbackInfo&) -> Napi::Value {
+        return engine->next(stream);
+    }, "next"));
+    handle.Set("cancel", Napi::Function::New(env, [engine, stream](const Napi::CallbackInfo&) {
+        engine->cancel(stream);
+    }, "cancel"));
+    return handle;
 }
 
-Napi::Value Connection::Commit(const Napi::CallbackInfo& info) {
+// Returns the native half of a COPY FROM STDIN, `{ write, end, done }`;
+// index.js wraps it in a Writable.
+Napi::Value Connection::CopyFrom(const Napi::CallbackInfo& info) {
     auto env = info.Env();
-    auto deferred = Napi::Promise::Deferred::New(env);
-    auto* worker = new QueryWorker(env, pool_, "COMMIT", {}, deferred);
-    worker->Queue();
-    return deferred.Promise();
+    auto copy = std::make_shared<CopyStream>(false);
+    auto op = std::make_unique<QueryOp>(env);
+    op->copy = copy;
+    op->statements.push_back({info[0].As<Napi::String>().Utf8Value(), {}});
+
+    auto engine = engine_;
+    auto handle = Napi::Object::New(env);
+    handle.Set("done", engine_->submit(std::move(op)));
+    handle.Set("write", Napi::Function::New(env, [engine, copy](const Napi::CallbackInfo& info) -> Napi::Value {
+        if (!info[0].IsBuffer()) {
+            Napi::TypeError::New(info.Env(), "COPY data must be a Buffer").ThrowAsJavaScriptException();
+            return info.Env().Undefined();
+        }
+        auto buf = info[0].As<Napi::Buffer<char>>();
+        return engine->writeCopy(copy, std::string(buf.Data(), buf.Length()));
+    }, "write"));
+    handle.Set("end", Napi::Function::New(env, [engine, copy](const Napi::CallbackInfo& info) {
+        engine->endCopy(copy, info[0].IsString() ? info[0].As<Napi::String>().Utf8Value() : std::string());
+    }, "end"));
+    return handle;
 }
 
-Napi::Value Connection::Rollback(const Napi::CallbackInfo& info) {
+// Returns the native half of a COPY TO STDOUT, `{ read, cancel, done }`;
+// index.js wraps it in a Readable.
+Napi::Value Connection::CopyTo(const Napi::CallbackInfo& info) {
     auto env = info.Env();
-    auto deferred = Napi::Promise::Deferred::New(env);
-    auto* worker = new QueryWorker(env, pool_, "ROLLBACK", {}, deferred);
-    worker->Queue();
-    return deferred.Promise();
+    auto copy = std::make_shared<CopyStream>(true);
+    auto op = std::make_unique<QueryOp>(env);
+    op->copy = copy;
+    op->statements.push_back({info[0].As<Napi::String>().Utf8Value(), {}});
+
+    auto engine = engine_;
+    auto handle = Napi::Object::New(env);
+    handle.Set("done", engine_->submit(std::move(op)));
+    handle.Set("read", Napi::Function::New(env, [engine, copy](const Napi::CallbackInfo&) -> Napi::Value {
+        return engine->readCopy(copy);
+    }, "read"));
+    handle.Set("cancel", Napi::Function::New(env, [engine, copy](const Napi::CallbackInfo&) {
+        engine->cancel(copy);
+    }, "cancel"));
+    return handle;
 }
 
+// Returns the native half of a PoolClient, `{ ready, query, release }`;
+// index.js wraps it once `ready` resolves with the connection pinned.
+Napi::Value Connection::Connect(const Napi::CallbackInfo& info) {
+    auto env = info.Env();
+    auto session = std::make_shared<Session>();
+    auto engine = engine_;
+    bool binary = binary_;
+
+    auto handle = Napi::Object::New(env);
+    handle.Set("ready", engine_->connect(session));
+    handle.Set("query", Napi::Function::New(env, [engine, session, binary](const Napi::CallbackInfo& info) -> Napi::Value {
+        auto op = ReadQuery(info, binary);
+        if (!op) return info.Env().Undefined();
+        op->session = session;
+        return engine->submit(std::move(op));
+    }, "query"));
+    handle.Set("release", Napi::Function::New(env, [engine, session](const Napi::CallbackInfo& info) {
+        engine->release(session, info[0].ToBoolean().Value());
+    }, "release"));
+    return handle;
+}
+
+// Every channel shares one listener connection of its own, outside the pool.
 Napi::Value Connection::Listen(const Napi::CallbackInfo& info) {
     auto env = info.Env();
     std::string channel = info[0].As<Napi::String>().Utf8Value();
     auto callback = info[1].As<Napi::Function>();
     
-    auto conn = pool_->acquire();
-    if (!conn) {
-        Napi::Error::New(env, "Failed to acquire connection for listener").ThrowAsJavaScriptException();
+    if (pool_->closed()) {
+        Napi::Error::New(env, "Connection closed").ThrowAsJavaScriptException();
         return env.Undefined();
     }
-    
-    std::string connStr = conn->connection_string();
-    pool_->release(conn);
-    
-    auto listener = std::make_unique<Listener>(connStr, channel, callback);
-    listener->start();
-    listeners_[channel] = std::move(listener);
+    if (!listener_) listener_ = std::make_unique<Listener>(env, connStr_);
+    listener_->listen(channel, callback);
     
     return env.Undefined();
 }
 
 Napi::Value Connection::Unlisten(const Napi::CallbackInfo& info) {
     std::string channel = info[0].As<Napi::String>().Utf8Value();
-    
-    auto it = listeners_.find(channel);
-    if (it != listeners_.end()) {
-        it->second->stop();
-        listeners_.erase(it);
-    }
-    
+    if (listener_) listener_->unlisten(channel);
     return info.Env().Undefined();
 }
 
 Napi::Value Connection::Close(const Napi::CallbackInfo& info) {
-    for (auto& [_, listener] : listeners_) listener->stop();
-    listeners_.clear();
-    pool_->close();
+    if (listener_) listener_->stop();
+    engine_->close();
+    detachPool();
     return info.Env().Undefined();
 }
 
@@ -350,5 +517,106 @@ Napi::Value Connection::PoolStatus(const Napi::CallbackInfo& info) {
     stats.Set("current", Napi::Number::New(env, pool_->currentCount()));
     stats.Set("max", Napi::Number::New(env, pool_->maxSize()));
     stats.Set("closed", Napi::Boolean::New(env, pool_->closed()));
+    
+    auto& statementStats = pool_->statementStats();
+    Napi::Object statements = Napi::Object::New(env);
+    statements.Set("hits", Napi::Number::New(env, static_cast<double>(statementStats.hits.load())));
+    statements.Set("misses", Napi::Number::New(env, static_cast<double>(statementStats.misses.load())));
+    statements.Set("evictions", Napi::Number::New(env, static_cast<double>(statementStats.evictions.load())));
+    stats.Set("statements", statements);
+
+    auto waitStats = pool_->waitStats();
+    Napi::Object queue = Napi::Object::New(env);
+    queue.Set("waiting", Napi::Number::New(env, waitStats.waiting));
+    queue.Set("peakWaiting", Napi::Number::New(env, waitStats.peakWaiting));
+    queue.Set("waits", Napi::Number::New(env, static_cast<double>(waitStats.waits)));
+    queue.Set("avgWaitMs", Napi::Number::New(env, waitStats.waits ? waitStats.totalWaitMs / waitStats.waits : 0));
+    queue.Set("timeouts", Napi::Number::New(env, static_cast<double>(waitStats.timeouts)));
+    queue.Set("shed", Napi::Number::New(env, static_cast<double>(waitStats.shed)));
+    stats.Set("queue", queue);
+
+    Napi::Object priorities = Napi::Object::New(env);
+    for (auto priority : {Priority::Interactive, Priority::Batch}) {
+        auto i = static_cast<size_t>(priority);
+        Napi::Object entry = Napi::Object::New(env);
+        entry.Set("busy", Napi::Number::New(env, waitStats.busy[i]));
+        entry.Set("waiting", Napi::Number::New(env, waitStats.queued[i]));
+        priorities.Set(priority == Priority::Batch ? "batch" : "interactive", entry);
+    }
+    stats.Set("priorities", priorities);
+    
+    if (auto* cache = engine_->cache()) {
+        auto cacheStats = cache->stats();
+        uint64_t lookups = cacheStats.hits + cacheStats.misses;
+        Napi::Object results = Napi::Object::New(env);
+        results.Set("hits", Napi::Number::New(env, static_cast<double>(cacheStats.hits)));
+        results.Set("misses", Napi::Number::New(env, static_cast<double>(cacheStats.misses)));
+        results.Set("hitRatio", Napi::Number::New(env, lookups ? static_cast<double>(cacheStats.hits) / lookups : 0));
+        results.Set("entries", Napi::Number::New(env, cacheStats.entries));
+        results.Set("bytes", Napi::Number::New(env, cacheStats.bytes));
+        results.Set("maxBytes", Napi::Number::New(env, cacheStats.maxBytes));
+        results.Set("evictions", Napi::Number::New(env, static_cast<double>(cacheStats.evictions)));
+        results.Set("invalidations", Napi::Number::New(env, static_cast<double>(cacheStats.invalidations)));
+        stats.Set("cache", results);
+    }
+
+    if (replicas_) {
+        auto hostStatus = [&](const std::string& name, const char* role, ConnectionPool& pool) {
+            Napi::Object host = Napi::Object::New(env);
+            host.Set("host", Napi::String::New(env, name));
+            host.Set("role", Napi::String::New(env, role));
+            host.Set("available", Napi::Number::New(env, pool.availableCount()));
+            host.Set("current", Napi::Number::New(env, pool.currentCount()));
+            host.Set("max", Napi::Number::New(env, pool.maxSize()));
+            return host;
+        };
+        const auto& replicas = replicas_->hosts();
+        Napi::Array hosts = Napi::Array::New(env, replicas.size() + 1);
+        hosts.Set(0u, hostStatus(ReplicaSet::HostName(connStr_), "primary", *pool_));
+        for (size_t i = 0; i < replicas.size(); ++i) {
+            const auto& replica = replicas[i];
+            auto host = hostStatus(replica.name, "replica", *replica.pool);
+            host.Set("outstanding", Napi::Number::New(env, replica.outstanding));
+            host.Set("latencyMs", Napi::Number::New(env, replica.latencyMs));
+            host.Set("queries", Napi::Number::New(env, static_cast<double>(replica.queries)));
+            host.Set("healthy", Napi::Boolean::New(env, !replicas_->ejected(replica)));
+            host.Set("ejections", Napi::Number::New(env, static_cast<double>(replica.ejections)));
+            hosts.Set(static_cast<uint32_t>(i + 1), host);
+        }
+        stats.Set("hosts", hosts);
+    }
     return stats;
 }
+
+static Napi::Object HistogramSnapshot(Napi::Env env, const LatencyHistogram& histogram) {
+    Napi::Object snapshot = Napi::Object::New(env);
+    snapshot.Set("count", Napi::Number::New(env, static_cast<double>(histogram.count())));
+    snapshot.Set("meanMs", Napi::Number::New(env, histogram.meanMs()));
+    snapshot.Set("p50Ms", Napi::Number::New(env, histogram.percentileMs(0.5)));
+    snapshot.Set("p90Ms", Napi::Number::New(env, histogram.percentileMs(0.9)));
+    snapshot.Set("p99Ms", Napi::Number::New(env, histogram.percentileMs(0.99)));
+    snapshot.Set("maxMs", Napi::Number::New(env, histogram.maxMs()));
+    return snapshot;
+}
+
+Napi::Value Connection::Metrics(const Napi::CallbackInfo& info) {
+    auto env = info.Env();
+    const auto& metrics = engine_->metrics();
+    Napi::Object snapshot = Napi::Object::New(env);
+    snapshot.Set("queries", Napi::Number::New(env, static_cast<double>(metrics.queries)));
+    snapshot.Set("errors", Napi::Number::New(env, static_cast<double>(metrics.errors)));
+    snapshot.Set("rows", Napi::Number::New(env, static_cast<double>(metrics.rows)));
+    snapshot.Set("bytes", Napi::Number::New(env, static_cast<double>(metrics.bytes)));
+    snapshot.Set("slowQueries", Napi::Number::New(env, static_cast<double>(metrics.slowQueries)));
+    snapshot.Set("cached", Napi::Number::New(env, static_cast<double>(metrics.cached)));
+    snapshot.Set("acquire", HistogramSnapshot(env, metrics.acquire));
+    snapshot.Set("execute", HistogramSnapshot(env, metrics.execute));
+    snapshot.Set("decode", HistogramSnapshot(env, metrics.decode));
+    snapshot.Set("total", HistogramSnapshot(env, metrics.total));
+
+    auto connectStats = pool_->connectStats();
+    auto connect = HistogramSnapshot(env, connectStats.latency);
+    connect.Set("failures", Napi::Number::New(env, static_cast<double>(connectStats.failures)));
+    snapshot.Set("connect", connect);
+    return snapshot;
+}
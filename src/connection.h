@@ -2,6 +2,7 @@
 #include <napi.h>
 #include "connection_pool.h"
 #include "listener.h"
+#include "query_engine.h"
 #include <memory>
 #include <unordered_map>
 
@@ -17,15 +18,25 @@ private:
     Napi::Value Prepare(const Napi::CallbackInfo& info);
     Napi::Value Execute(const Napi::CallbackInfo& info);
     Napi::Value Pipeline(const Napi::CallbackInfo& info);
-    Napi::Value Begin(const Napi::CallbackInfo& info);
-    Napi::Value Commit(const Napi::CallbackInfo& info);
-    Napi::Value Rollback(const Napi::CallbackInfo& info);
+    Napi::Value Stream(const Napi::CallbackInfo& info);
+    Napi::Value CopyFrom(const Napi::CallbackInfo& info);
+    Napi::Value CopyTo(const Napi::CallbackInfo& info);
+    Napi::Value Connect(const Napi::CallbackInfo& info);
     Napi::Value Listen(const Napi::CallbackInfo& info);
     Napi::Value Unlisten(const Napi::CallbackInfo& info);
     Napi::Value Close(const Napi::CallbackInfo& info);
     Napi::Value PoolStatus(const Napi::CallbackInfo& info);
+    Napi::Value Metrics(const Napi::CallbackInfo& info);
+    static void OnEnvCleanup(void* arg);
+    void detachPool();
 
     std::shared_ptr<ConnectionPool> pool_;
-    std::unordered_map<std::string, std::unique_ptr<Listener>> listeners_;
+    std::shared_ptr<ReplicaSet> replicas_;
+    std::shared_ptr<QueryEngine> engine_;
+    std::string connStr_;
+    std::unique_ptr<Listener> listener_;
     std::unordered_map<std::string, std::string> prepared_;
+    bool binary_ = false;
+    bool sharedPool_ = false;
+    bool detached_ = false;
 };
@@ -1,44 +1,57 @@
 #include "connection_pool.h"
+#include <algorithm>
+#include <future>
+#include <random>
 #include <thread>
 
-ConnectionPool::ConnectionPool(const std::string& connStr, size_t poolSize)
-    : connStr_(connStr), poolSize_(poolSize), currentSize_(0) {
-    try {
-        auto conn = createConnection();
-        if (conn) {
-            available_.push_back({conn, std::chrono::steady_clock::now()});
-            currentSize_ = 1;
-        }
-    } catch (...) {}
-    
-    if (poolSize > 1) {
-        std::thread([this, connStr, poolSize]() {
-            for (size_t i = 1; i < poolSize; ++i) {
-                try {
-                    auto conn = std::make_shared<pqxx::connection>(connStr);
-                    if (conn && conn->is_open()) {
-                        std::lock_guard<std::mutex> lock(mutex_);
-                        if (!closed_) {
-                            available_.push_back({conn, std::chrono::steady_clock::now()});
-                            currentSize_++;
-                        }
-                    }
-                } catch (...) {
-                    break;
-                }
-            }
-        }).detach();
+const std::string* StatementCache::find(const std::string& sql) {
+    auto it = entries_.find(sql);
+    if (it == entries_.end()) return nullptr;
+    if (!it->second.pinned) lru_.splice(lru_.begin(), lru_, it->second.lru);
+    return &it->second.name;
+}
+
+const std::string& StatementCache::add(const std::string& sql, bool pinned, size_t capacity, std::string* evicted) {
+    if (!pinned && capacity > 0 && lru_.size() >= capacity) {
+        auto victim = entries_.find(lru_.back());
+        *evicted = victim->second.name;
+        entries_.erase(victim);
+        lru_.pop_back();
+    }
+
+    Entry entry{"pgnx_" + std::to_string(nextId_++), pinned, lru_.end()};
+    if (!pinned) {
+        lru_.push_front(sql);
+        entry.lru = lru_.begin();
     }
+    auto& slot = entries_[sql];
+    slot = std::move(entry);
+    return slot.name;
+}
+
+void StatementCache::forget(const std::string& sql) {
+    auto it = entries_.find(sql);
+    if (it == entries_.end()) return;
+    if (!it->second.pinned) lru_.erase(it->second.lru);
+    entries_.erase(it);
+}
+
+ConnectionPool::ConnectionPool(const std::string& connStr, size_t poolSize, PoolOptions options)
+    : connStr_(connStr), poolSize_(poolSize), currentSize_(0), options_(options) {
+    options_.min = std::min(options_.min, poolSize_);
+    // Prewarming is the maintenance thread's first pass, so the constructor
+    // never blocks on a handshake.
+    maintainer_ = std::thread([this]() { maintain(); });
 }
 
 ConnectionPool::~ConnectionPool() {
     close();
 }
 
-bool ConnectionPool::isHealthy(const std::shared_ptr<pqxx::connection>& conn) {
-    if (!conn || !conn->is_open()) return false;
+bool ConnectionPool::isHealthy(const std::shared_ptr<PgConnection>& conn) {
+    if (!conn || PQstatus(conn->raw) != CONNECTION_OK) return false;
     try {
-        pqxx::nontransaction txn(*conn);
+        pqxx::nontransaction txn(conn->conn);
         txn.exec("SELECT 1");
         return true;
     } catch (...) {
@@ -46,26 +59,60 @@ bool ConnectionPool::isHealthy(const std::shared_ptr<pqxx::connection>& conn) {
     }
 }
 
-std::shared_ptr<pqxx::connection> ConnectionPool::createConnection() {
+// Reads whatever the server has sent without waiting. libpq sockets are
+// always non-blocking, and a closed peer flips the status to CONNECTION_BAD.
+static bool SocketAlive(PGconn* raw) {
+    return PQstatus(raw) == CONNECTION_OK && PQconsumeInput(raw) && PQstatus(raw) == CONNECTION_OK;
+}
+
+// Spreads recycling over the last tenth of the lifetime so connections opened
+// together are not all replaced in the same instant.
+static std::chrono::steady_clock::time_point RetireAt(std::chrono::milliseconds lifetime) {
+    if (lifetime.count() == 0) return std::chrono::steady_clock::time_point::max();
+    thread_local std::mt19937_64 rng(std::random_device{}());
+    std::uniform_int_distribution<int64_t> jitter(0, lifetime.count() / 10);
+    return std::chrono::steady_clock::now() + lifetime - std::chrono::milliseconds(jitter(rng));
+}
+
+std::shared_ptr<PgConnection> ConnectionPool::createConnection(std::string* error) {
+    auto started = std::chrono::steady_clock::now();
+    PGconn* raw = PQconnectdb(connStr_.c_str());
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        connectStats_.latency.record(std::chrono::steady_clock::now() - started);
+        if (!raw || PQstatus(raw) != CONNECTION_OK) connectStats_.failures++;
+    }
+    if (!raw) {
+        if (error) *error = "out of memory";
+        return nullptr;
+    }
+    if (PQstatus(raw) != CONNECTION_OK) {
+        if (error) {
+            *error = PQerrorMessage(raw);
+            while (!error->empty() && (error->back() == '\n' || error->back() == ' ')) error->pop_back();
+        }
+        PQfinish(raw);
+        return nullptr;
+    }
     try {
-        auto conn = std::make_shared<pqxx::connection>(connStr_);
-        if (conn->is_open()) return conn;
-    } catch (...) {}
+        auto conn = std::make_shared<PgConnection>(raw);
+        conn->retireAt = RetireAt(options_.maxLifetime);
+        return conn;
+    } catch (const std::exception& e) {
+        if (error) *error = e.what();
+    }
     return nullptr;
 }
 
-std::shared_ptr<pqxx::connection> ConnectionPool::acquire() {
-    std::lock_guard<std::mutex> lock(mutex_);
-    
-    auto now = std::chrono::steady_clock::now();
-    
+// Takes the most recently used idle connection. Staleness is the maintenance
+// thread's job; only a socket libpq already knows is bad gets skipped here.
+// Caller holds the lock.
+std::shared_ptr<PgConnection> ConnectionPool::popIdle() {
     while (!available_.empty()) {
-        auto pooled = available_.back();
+        auto pooled = std::move(available_.back());
         available_.pop_back();
         
-        auto idleSeconds = std::chrono::duration_cast<std::chrono::seconds>(now - pooled.lastUsed).count();
-        
-        if (idleSeconds > MAX_IDLE_SECONDS || !isHealthy(pooled.conn)) {
+        if (PQstatus(pooled.conn->raw) != CONNECTION_OK) {
             currentSize_--;
             continue;
         }
@@ -73,30 +120,365 @@ std::shared_ptr<pqxx::connection> ConnectionPool::acquire() {
         return pooled.conn;
     }
     
-    if (currentSize_ < poolSize_ && !closed_) {
+    return nullptr;
+}
+
+static size_t Class(Priority priority) {
+    return static_cast<size_t>(priority);
+}
+
+// How many connections `priority` may hold at once. Caller holds the lock.
+size_t ConnectionPool::limitLocked(Priority priority) const {
+    if (priority == Priority::Interactive) return poolSize_ - std::min(options_.reservedBatch, poolSize_);
+    size_t limit = poolSize_ - std::min(options_.reservedInteractive, poolSize_);
+    return options_.maxBatch > 0 ? std::min(limit, options_.maxBatch) : limit;
+}
+
+// Whether a new request may take an idle connection now: its class has room
+// and nobody queued would be served before it. Caller holds the lock.
+bool ConnectionPool::mayTakeLocked(Priority priority) const {
+    if (busy_[Class(priority)] >= limitLocked(priority)) return false;
+    return priority == Priority::Interactive ? queued_[Class(Priority::Interactive)] == 0 : waiters_.empty();
+}
+
+// The oldest interactive request, else the oldest batch one, skipping a
+// class that holds all it may. Caller holds the lock.
+std::deque<ConnectionPool::Waiter>::iterator ConnectionPool::nextWaiterLocked() {
+    for (auto priority : {Priority::Interactive, Priority::Batch}) {
+        if (queued_[Class(priority)] == 0 || busy_[Class(priority)] >= limitLocked(priority)) continue;
+        return std::find_if(waiters_.begin(), waiters_.end(), [&](const Waiter& w) { return w.priority == priority; });
+    }
+    return waiters_.end();
+}
+
+// Queued requests a new connection could serve. Caller holds the lock.
+size_t ConnectionPool::demandLocked() const {
+    size_t demand = 0;
+    for (auto priority : {Priority::Interactive, Priority::Batch}) {
+        size_t limit = limitLocked(priority);
+        size_t busy = busy_[Class(priority)];
+        demand += std::min(queued_[Class(priority)], limit > busy ? limit - busy : 0);
+    }
+    return demand;
+}
+
+void ConnectionPool::holdLocked(PgConnection& conn, Priority priority) {
+    conn.priority = priority;
+    conn.held = true;
+    busy_[Class(priority)]++;
+}
+
+void ConnectionPool::unholdLocked(PgConnection& conn) {
+    if (!conn.held) return;
+    conn.held = false;
+    busy_[Class(conn.priority)]--;
+}
+
+// Load shedding for a request about to queue. Returns why it is rejected, or
+// nothing; batch requests it pushes out to make room go into `shed`. Caller
+// holds the lock.
+std::string ConnectionPool::admitLocked(Priority priority, std::deque<Waiter>& shed) {
+    if (options_.maxQueueWait.count() > 0) {
+        auto oldest = std::find_if(waiters_.begin(), waiters_.end(), [&](const Waiter& w) { return w.priority == priority; });
+        if (oldest != waiters_.end() && std::chrono::steady_clock::now() - oldest->since >= options_.maxQueueWait) {
+            return "Connection pool overloaded: queued requests have waited over " +
+                   std::to_string(options_.maxQueueWait.count()) + "ms";
+        }
+    }
+    if (options_.maxQueue == 0 || waiters_.size() < options_.maxQueue) return std::string();
+    if (priority == Priority::Batch || queued_[Class(Priority::Batch)] == 0) {
+        return "Connection pool overloaded: " + std::to_string(waiters_.size()) + " requests queued";
+    }
+    auto newest = std::find_if(waiters_.rbegin(), waiters_.rend(), [](const Waiter& w) { return w.priority == Priority::Batch; });
+    shed.push_back(std::move(*newest));
+    waiters_.erase(std::next(newest).base());
+    queued_[Class(Priority::Batch)]--;
+    return std::string();
+}
+
+std::shared_ptr<PgConnection> ConnectionPool::acquire(bool wait) {
+    if (wait) {
+        using Grant = std::pair<std::shared_ptr<PgConnection>, std::string>;
+        auto granted = std::make_shared<std::promise<Grant>>();
+        auto future = granted->get_future();
+        Ticket ticket = acquireAsync([granted](std::shared_ptr<PgConnection> c, const std::string& error, bool) {
+            granted->set_value({std::move(c), error});
+        });
+        auto timeout = options_.connectionTimeout;
+        if (timeout.count() > 0 && future.wait_for(timeout) == std::future_status::timeout && cancel(ticket)) {
+            noteTimeout();
+            return nullptr;
+        }
+        return future.get().first;
+    }
+    
+    std::shared_ptr<PgConnection> conn;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (closed_ || !mayTakeLocked(Priority::Interactive)) return nullptr;
+        conn = popIdle();
+        if (conn) holdLocked(*conn, Priority::Interactive);
+        if (conn || currentSize_ >= poolSize_) return conn;
         currentSize_++;
-        auto conn = createConnection();
-        if (conn) return conn;
-        currentSize_--;
+    }
+    conn = createConnection();
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!conn) {
+        if (!closed_ && currentSize_ > 0) currentSize_--;
+        growLocked();
+    } else {
+        holdLocked(*conn, Priority::Interactive);
+    }
+    return conn;
+}
+
+// Hot-path variant for the event loop: never touches the network, so a
+// broken idle connection is only noticed by its PQstatus.
+std::shared_ptr<PgConnection> ConnectionPool::tryAcquire(Priority priority) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (closed_ || !mayTakeLocked(priority)) return nullptr;
+    auto conn = popIdle();
+    if (conn) holdLocked(*conn, priority);
+    return conn;
+}
+
+ConnectionPool::Ticket ConnectionPool::acquireAsync(AcquireCallback done, Priority priority) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    Ticket ticket = nextTicket_++;
+    
+    if (closed_) {
+        lock.unlock();
+        done(nullptr, "Connection pool closed", false);
+        return ticket;
+    }
+    if (mayTakeLocked(priority)) {
+        if (auto conn = popIdle()) {
+            holdLocked(*conn, priority);
+            lock.unlock();
+            done(std::move(conn), std::string(), false);
+            return ticket;
+        }
     }
     
-    return nullptr;
+    std::deque<Waiter> shed;
+    auto rejected = admitLocked(priority, shed);
+    if (rejected.empty()) {
+        waiters_.push_back({ticket, std::move(done), std::chrono::steady_clock::now(), priority});
+        queued_[Class(priority)]++;
+        waitStats_.peakWaiting = std::max(waitStats_.peakWaiting, waiters_.size());
+        growLocked();
+    }
+    waitStats_.shed += shed.size() + (rejected.empty() ? 0 : 1);
+    lock.unlock();
+    
+    for (auto& waiter : shed) waiter.done(nullptr, "Connection pool overloaded: displaced by an interactive request", true);
+    if (!rejected.empty()) done(nullptr, rejected, true);
+    return ticket;
 }
 
-void ConnectionPool::release(std::shared_ptr<pqxx::connection> conn) {
-    if (!conn || !conn->is_open()) return;
+bool ConnectionPool::cancel(Ticket ticket) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto it = waiters_.begin(); it != waiters_.end(); ++it) {
+        if (it->ticket != ticket) continue;
+        queued_[Class(it->priority)]--;
+        waiters_.erase(it);
+        return true;
+    }
+    return false;
+}
+
+// Opens a connection per queued request that one could serve while there is
+// room, each on its own thread so a slow handshake holds up nobody else.
+// Caller holds the lock.
+void ConnectionPool::growLocked() {
+    while (!closed_ && connecting_ < demandLocked() && currentSize_ < poolSize_) {
+        currentSize_++;
+        connecting_++;
+        std::thread([self = shared_from_this()]() { self->openForWaiters(); }).detach();
+    }
+}
+
+void ConnectionPool::openForWaiters() {
+    std::string error;
+    auto conn = createConnection(&error);
+    
+    std::unique_lock<std::mutex> lock(mutex_);
+    connecting_--;
+    if (conn) {
+        lock.unlock();
+        release(std::move(conn));
+        return;
+    }
+    
+    if (!closed_ && currentSize_ > 0) currentSize_--;
+    // Every open connection is busy and will come back to the queue; with
+    // none open or opening, nothing ever would.
+    if (currentSize_ > 0 || connecting_ > 0) return;
+    auto failed = std::move(waiters_);
+    waiters_.clear();
+    queued_[0] = queued_[1] = 0;
+    lock.unlock();
+    
+    for (auto& waiter : failed) waiter.done(nullptr, "Failed to acquire connection from pool: " + error, false);
+}
+
+void ConnectionPool::recordWaitLocked(const Waiter& waiter) {
+    auto waited = std::chrono::steady_clock::now() - waiter.since;
+    waitStats_.waits++;
+    waitStats_.totalWaitMs += std::chrono::duration<double, std::milli>(waited).count();
+}
+
+// Queued requests are served first, in arrival order.
+void ConnectionPool::release(std::shared_ptr<PgConnection> conn) {
+    if (!conn) return;
+    if (PQstatus(conn->raw) != CONNECTION_OK || std::chrono::steady_clock::now() >= conn->retireAt) {
+        discard(conn);
+        return;
+    }
+    auto now = std::chrono::steady_clock::now();
+    putBack({std::move(conn), now, now});
+}
+
+void ConnectionPool::putBack(PooledConnection pooled) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (closed_) return;
+    unholdLocked(*pooled.conn);
+    auto next = nextWaiterLocked();
+    if (next == waiters_.end()) {
+        available_.push_back(std::move(pooled));
+        return;
+    }
+    
+    auto waiter = std::move(*next);
+    waiters_.erase(next);
+    queued_[Class(waiter.priority)]--;
+    recordWaitLocked(waiter);
+    holdLocked(*pooled.conn, waiter.priority);
+    lock.unlock();
+    waiter.done(std::move(pooled.conn), std::string(), false);
+}
+
+void ConnectionPool::discard(std::shared_ptr<PgConnection> conn) {
+    if (!conn) return;
     
     std::lock_guard<std::mutex> lock(mutex_);
-    if (!closed_) {
-        available_.push_back({conn, std::chrono::steady_clock::now()});
+    unholdLocked(*conn);
+    if (!closed_ && currentSize_ > 0) currentSize_--;
+    growLocked();
+    if (currentSize_ < options_.min) {
+        refill_ = true;
+        wake_.notify_one();
     }
 }
 
 void ConnectionPool::close() {
+    std::deque<Waiter> waiters;
+    std::vector<PooledConnection> idle;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        idle.swap(available_);
+        currentSize_ = 0;
+        waiters = std::move(waiters_);
+        waiters_.clear();
+        queued_[0] = queued_[1] = 0;
+    }
+    wake_.notify_all();
+    if (maintainer_.joinable()) {
+        if (maintainer_.get_id() == std::this_thread::get_id()) {
+            maintainer_.detach();
+        } else {
+            maintainer_.join();
+        }
+    }
+    for (auto& waiter : waiters) waiter.done(nullptr, "Connection pool closed", false);
+}
+
+// One pass per MAINTENANCE_INTERVAL, or sooner when a discard leaves the pool
+// under `min`. Sockets are probed every pass; a real round trip only happens
+// for connections that have sat idle past PING_INTERVAL. Connections are
+// closed and opened outside the lock.
+void ConnectionPool::maintain() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!closed_) {
+        auto now = std::chrono::steady_clock::now();
+        std::vector<PooledConnection> dropped;
+        std::vector<PooledConnection> probe;
+        
+        // Oldest first, so trimming to `min` keeps the most recently used.
+        for (auto it = available_.begin(); it != available_.end();) {
+            bool idleTooLong = options_.idleTimeout.count() > 0 && now - it->lastUsed >= options_.idleTimeout &&
+                               currentSize_ > options_.min;
+            if (idleTooLong || now >= it->conn->retireAt || !SocketAlive(it->conn->raw)) {
+                dropped.push_back(std::move(*it));
+                it = available_.erase(it);
+                currentSize_--;
+            } else if (now - it->lastChecked >= PING_INTERVAL) {
+                probe.push_back(std::move(*it));
+                it = available_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        
+        // Slots are reserved up front so queued requests don't open the same
+        // connections again.
+        size_t missing = currentSize_ < options_.min ? options_.min - currentSize_ : 0;
+        currentSize_ += missing;
+        refill_ = false;
+        
+        lock.unlock();
+        dropped.clear();
+        for (auto& pooled : probe) {
+            if (isHealthy(pooled.conn)) {
+                pooled.lastChecked = std::chrono::steady_clock::now();
+                putBack(std::move(pooled));
+            } else {
+                discard(std::move(pooled.conn));
+            }
+        }
+        for (; missing > 0; --missing) {
+            auto conn = createConnection();
+            if (conn) {
+                auto opened = std::chrono::steady_clock::now();
+                putBack({std::move(conn), opened, opened});
+                continue;
+            }
+            // Try again next pass rather than hammering a server that is down.
+            std::lock_guard<std::mutex> relock(mutex_);
+            if (!closed_) currentSize_ -= missing;
+            break;
+        }
+        lock.lock();
+        
+        wake_.wait_for(lock, MAINTENANCE_INTERVAL, [this]() { return closed_ || refill_; });
+    }
+}
+
+void ConnectionPool::noteTimeout() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    waitStats_.timeouts++;
+}
+
+WaitStats ConnectionPool::waitStats() {
     std::lock_guard<std::mutex> lock(mutex_);
-    closed_ = true;
-    available_.clear();
-    currentSize_ = 0;
+    WaitStats stats = waitStats_;
+    stats.waiting = waiters_.size();
+    for (size_t i = 0; i < 2; ++i) {
+        stats.busy[i] = busy_[i];
+        stats.queued[i] = queued_[i];
+    }
+    return stats;
+}
+
+size_t ConnectionPool::waiting(Priority priority) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return queued_[Class(priority)];
+}
+
+ConnectStats ConnectionPool::connectStats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return connectStats_;
 }
 
 size_t ConnectionPool::availableCount() {
@@ -117,3 +499,48 @@ bool ConnectionPool::closed() {
     std::lock_guard<std::mutex> lock(mutex_);
     return closed_;
 }
+
+namespace {
+struct SharedPool {
+    std::shared_ptr<ConnectionPool> pool;
+    size_t holders;
+};
+std::mutex sharedMutex;
+std::unordered_map<std::string, SharedPool> sharedPools;
+}
+
+static std::string SharedKey(const std::string& connStr, size_t poolSize, const PoolOptions& options) {
+    return connStr + '\n' + std::to_string(poolSize) + ',' + std::to_string(options.min) + ',' +
+           std::to_string(options.connectionTimeout.count()) + ',' + std::to_string(options.idleTimeout.count()) + ',' +
+           std::to_string(options.maxLifetime.count()) + ',' + std::to_string(options.reservedInteractive) + ',' +
+           std::to_string(options.reservedBatch) + ',' + std::to_string(options.maxBatch) + ',' +
+           std::to_string(options.maxQueue) + ',' + std::to_string(options.maxQueueWait.count());
+}
+
+std::shared_ptr<ConnectionPool> AcquireSharedPool(const std::string& connStr, size_t poolSize, const PoolOptions& options) {
+    std::lock_guard<std::mutex> lock(sharedMutex);
+    auto& shared = sharedPools[SharedKey(connStr, poolSize, options)];
+    if (!shared.pool) {
+        shared.pool = std::make_shared<ConnectionPool>(connStr, poolSize, options);
+        shared.pool->markShared();
+    }
+    shared.holders++;
+    return shared.pool;
+}
+
+void ReleaseSharedPool(const std::shared_ptr<ConnectionPool>& pool) {
+    std::shared_ptr<ConnectionPool> last;
+    {
+        std::lock_guard<std::mutex> lock(sharedMutex);
+        for (auto it = sharedPools.begin(); it != sharedPools.end(); ++it) {
+            if (it->second.pool != pool) continue;
+            if (--it->second.holders == 0) {
+                last = std::move(it->second.pool);
+                sharedPools.erase(it);
+            }
+            break;
+        }
+    }
+    // Closing joins the maintenance thread, so not under the registry lock.
+    if (last) last->close();
+}
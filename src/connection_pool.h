@@ -1,38 +1,212 @@
 #pragma once
 #include <pqxx/pqxx>
+#include <libpq-fe.h>
+#include "metrics.h"
 #include <vector>
 #include <mutex>
 #include <memory>
 #include <string>
 #include <chrono>
+#include <atomic>
+#include <list>
+#include <deque>
+#include <functional>
+#include <condition_variable>
+#include <thread>
+#include <unordered_map>
+
+// Server-side prepared statements living on one backend, keyed by SQL text.
+// Pinned entries come from Connection::prepare and are never evicted;
+// auto-prepared query() text is kept least-recently-used up to a capacity.
+class StatementCache {
+public:
+    const std::string* find(const std::string& sql);
+    const std::string& add(const std::string& sql, bool pinned, size_t capacity, std::string* evicted);
+    void forget(const std::string& sql);
+
+private:
+    struct Entry {
+        std::string name;
+        bool pinned;
+        std::list<std::string>::iterator lru;
+    };
+
+    std::unordered_map<std::string, Entry> entries_;
+    std::list<std::string> lru_;
+    size_t nextId_ = 0;
+};
+
+struct StatementStats {
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+    std::atomic<uint64_t> evictions{0};
+};
+
+// Interactive requests are served ahead of batch ones, and each class can be
+// kept from taking the connections reserved for the other.
+enum class Priority { Interactive, Batch };
+
+// A pooled backend. `raw` is borrowed from `conn` so the query engine can
+// drive libpq's async API on the same socket libpqxx owns.
+struct PgConnection {
+    pqxx::connection conn;
+    PGconn* raw;
+    StatementCache statements;
+    // Recycled on its next return to the pool once this passes.
+    std::chrono::steady_clock::time_point retireAt = std::chrono::steady_clock::time_point::max();
+    // Whose it is while handed out; `held` is false while it sits in the pool.
+    Priority priority = Priority::Interactive;
+    bool held = false;
+
+    explicit PgConnection(PGconn* r) : conn(pqxx::connection::seize_raw_connection(r)), raw(r) {}
+};
 
 struct PooledConnection {
-    std::shared_ptr<pqxx::connection> conn;
+    std::shared_ptr<PgConnection> conn;
     std::chrono::steady_clock::time_point lastUsed;
+    std::chrono::steady_clock::time_point lastChecked;
 };
 
-class ConnectionPool {
+struct PoolOptions {
+    // Kept open even when idle, and opened in the background at startup.
+    size_t min = 1;
+    // How long a query may queue for a connection; 0 waits forever.
+    std::chrono::milliseconds connectionTimeout{0};
+    // Idle connections above `min` are closed after this; 0 keeps them.
+    std::chrono::milliseconds idleTimeout{300000};
+    // Connections are replaced after roughly this long; 0 keeps them.
+    std::chrono::milliseconds maxLifetime{0};
+    // Connections the other class can never hold.
+    size_t reservedInteractive = 0;
+    size_t reservedBatch = 0;
+    // Most connections batch work may hold at once; 0 leaves only the
+    // interactive reservation as a cap.
+    size_t maxBatch = 0;
+    // Load shedding: a request is rejected when this many are already
+    // queued, or while the oldest queued request of its class has waited
+    // this long. An interactive request arriving at a full queue pushes out
+    // the newest batch one instead, if there is one. 0 turns either off.
+    size_t maxQueue = 0;
+    std::chrono::milliseconds maxQueueWait{0};
+};
+
+// Time spent queued for a connection.
+struct WaitStats {
+    size_t waiting = 0;
+    size_t peakWaiting = 0;
+    uint64_t waits = 0;
+    double totalWaitMs = 0;
+    uint64_t timeouts = 0;
+    uint64_t shed = 0;
+    // Per Priority: connections handed out, and requests queued.
+    size_t busy[2] = {0, 0};
+    size_t queued[2] = {0, 0};
+};
+
+// Time spent opening connections, and how many attempts failed.
+struct ConnectStats {
+    LatencyHistogram latency;
+    uint64_t failures = 0;
+};
+
+// Called once with a connection, or with nullptr and the reason none can be
+// had; `shed` marks a request turned away by load shedding, as opposed to a
+// pool that cannot connect. It runs on whichever thread grants the request
+// and never under the pool's lock.
+using AcquireCallback = std::function<void(std::shared_ptr<PgConnection>, const std::string& error, bool shed)>;
+
+// Requests that find no idle connection wait in one queue and are served as
+// connections are released or opened: interactive ones first, each class in
+// arrival order and only up to its share of the pool. Connecting and health
+// checks happen outside the lock; new connections are opened on their own
+// thread, never on the caller's. A maintenance thread keeps `min` connections
+// open and drops idle, expired or dead ones, so acquiring is just a pop.
+class ConnectionPool : public std::enable_shared_from_this<ConnectionPool> {
 public:
-    ConnectionPool(const std::string& connStr, size_t poolSize);
+    using Ticket = uint64_t;
+
+    ConnectionPool(const std::string& connStr, size_t poolSize, PoolOptions options = {});
     ~ConnectionPool();
-    std::shared_ptr<pqxx::connection> acquire();
-    void release(std::shared_ptr<pqxx::connection> conn);
+    // Blocking. With `wait`, queues for up to the connection timeout (0 waits
+    // forever); without it, only takes an idle connection or opens one, which
+    // is what callers on the event loop need.
+    std::shared_ptr<PgConnection> acquire(bool wait = true);
+    // Idle connection or nothing; never jumps ahead of queued requests that
+    // would be served first.
+    std::shared_ptr<PgConnection> tryAcquire(Priority priority = Priority::Interactive);
+    Ticket acquireAsync(AcquireCallback done, Priority priority = Priority::Interactive);
+    // Withdraws a queued request; false if it has already been granted.
+    bool cancel(Ticket ticket);
+    void release(std::shared_ptr<PgConnection> conn);
+    void discard(std::shared_ptr<PgConnection> conn);
     void close();
+    void noteTimeout();
+    size_t waiting(Priority priority);
 
     size_t availableCount();
     size_t currentCount();
     size_t maxSize();
     bool closed();
+    // Set on pools from AcquireSharedPool, whose connections several engines
+    // take turns on.
+    bool shared() const { return shared_; }
+    void markShared() { shared_ = true; }
+    std::chrono::milliseconds connectionTimeout() const { return options_.connectionTimeout; }
+    WaitStats waitStats();
+    ConnectStats connectStats();
+    StatementStats& statementStats() { return statementStats_; }
 
 private:
-    bool isHealthy(const std::shared_ptr<pqxx::connection>& conn);
-    std::shared_ptr<pqxx::connection> createConnection();
-    
+    struct Waiter {
+        Ticket ticket;
+        AcquireCallback done;
+        std::chrono::steady_clock::time_point since;
+        Priority priority;
+    };
+
+    bool isHealthy(const std::shared_ptr<PgConnection>& conn);
+    std::shared_ptr<PgConnection> createConnection(std::string* error = nullptr);
+    std::shared_ptr<PgConnection> popIdle();
+    size_t limitLocked(Priority priority) const;
+    bool mayTakeLocked(Priority priority) const;
+    std::deque<Waiter>::iterator nextWaiterLocked();
+    size_t demandLocked() const;
+    void holdLocked(PgConnection& conn, Priority priority);
+    void unholdLocked(PgConnection& conn);
+    std::string admitLocked(Priority priority, std::deque<Waiter>& shed);
+    void growLocked();
+    void openForWaiters();
+    void recordWaitLocked(const Waiter& waiter);
+    void putBack(PooledConnection pooled);
+    void maintain();
+
     std::string connStr_;
     size_t poolSize_;
     size_t currentSize_;
+    size_t connecting_ = 0;
+    PoolOptions options_;
     std::vector<PooledConnection> available_;
+    std::deque<Waiter> waiters_;
+    Ticket nextTicket_ = 1;
+    // Per Priority: connections handed out, and requests waiting.
+    size_t busy_[2] = {0, 0};
+    size_t queued_[2] = {0, 0};
+    WaitStats waitStats_;
+    ConnectStats connectStats_;
     std::mutex mutex_;
     bool closed_ = false;
-    static constexpr int MAX_IDLE_SECONDS = 300;
+    bool shared_ = false;
+    bool refill_ = false;
+    std::condition_variable wake_;
+    std::thread maintainer_;
+    StatementStats statementStats_;
+    static constexpr std::chrono::seconds MAINTENANCE_INTERVAL{1};
+    static constexpr std::chrono::seconds PING_INTERVAL{30};
 };
+
+// Pools shared by every Connection in the process that asks for one with the
+// same connection string and settings, whatever thread or isolate it lives
+// on, so they draw from one set of connections under one max. Each holder
+// acquires once and releases once; the last release closes the pool.
+std::shared_ptr<ConnectionPool> AcquireSharedPool(const std::string& connStr, size_t poolSize, const PoolOptions& options);
+void ReleaseSharedPool(const std::shared_ptr<ConnectionPool>& pool);
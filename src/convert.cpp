@@ -0,0 +1,398 @@
+#include "convert.h"
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+static Napi::Value Int64Value(Napi::Env env, int64_t value) {
+    constexpr int64_t maxSafe = (int64_t(1) << 53) - 1;
+    if (value >= -maxSafe && value <= maxSafe) return Napi::Number::New(env, static_cast<double>(value));
+    return Napi::BigInt::New(env, value);
+}
+
+static std::string FormatUuid(const char* data) {
+    static const char hex[] = "0123456789abcdef";
+    std::string out;
+    out.reserve(36);
+    for (int i = 0; i < 16; ++i) {
+        if (i == 4 || i == 6 || i == 8 || i == 10) out += '-';
+        auto byte = static_cast<unsigned char>(data[i]);
+        out += hex[byte >> 4];
+        out += hex[byte & 0xf];
+    }
+    return out;
+}
+
+static std::string FormatTime(int64_t micros) {
+    char buf[32];
+    int len = std::snprintf(buf, sizeof(buf), "%02lld:%02lld:%02lld",
+                            static_cast<long long>(micros / 3600000000LL),
+                            static_cast<long long>(micros / 60000000LL % 60),
+                            static_cast<long long>(micros / 1000000LL % 60));
+    if (micros % 1000000 != 0) {
+        len += std::snprintf(buf + len, sizeof(buf) - len, ".%06lld", static_cast<long long>(micros % 1000000));
+        while (buf[len - 1] == '0') buf[--len] = '\0';
+    }
+    return buf;
+}
+
+// Numeric travels as base-10000 digits with a weight (position of the first
+// digit group) and a display scale; rebuild the exact decimal text.
+static std::string DecodeNumeric(const char* data, int len) {
+    if (len < 8) return "NaN";
+    int ndigits = static_cast<int16_t>(ReadU16(data));
+    int weight = static_cast<int16_t>(ReadU16(data + 2));
+    uint16_t sign = ReadU16(data + 4);
+    int dscale = static_cast<int16_t>(ReadU16(data + 6));
+
+    if (sign == 0xC000) return "NaN";
+    if (sign == 0xD000) return "Infinity";
+    if (sign == 0xF000) return "-Infinity";
+
+    std::vector<int> digits(ndigits);
+    for (int i = 0; i < ndigits && 8 + i * 2 + 2 <= len; ++i) {
+        digits[i] = static_cast<int16_t>(ReadU16(data + 8 + i * 2));
+    }
+
+    std::string out = sign == 0x4000 ? "-" : "";
+    char buf[8];
+    if (weight < 0) {
+        out += '0';
+    } else {
+        for (int i = 0; i <= weight; ++i) {
+            int d = i < ndigits ? digits[i] : 0;
+            std::snprintf(buf, sizeof(buf), i == 0 ? "%d" : "%04d", d);
+            out += buf;
+        }
+    }
+
+    if (dscale > 0) {
+        std::string frac;
+        for (int i = weight + 1; static_cast<int>(frac.size()) < dscale; ++i) {
+            int d = (i >= 0 && i < ndigits) ? digits[i] : 0;
+            std::snprintf(buf, sizeof(buf), "%04d", d);
+            frac += buf;
+        }
+        frac.resize(dscale);
+        out += '.';
+        out += frac;
+    }
+    return out;
+}
+
+static Napi::Value DecodeArrayLevel(Napi::Env env, const char*& p, const char* end,
+                                    const std::vector<int32_t>& dims, size_t level, Oid elemType) {
+    auto arr = Napi::Array::New(env, dims[level]);
+    for (int32_t i = 0; i < dims[level]; ++i) {
+        if (level + 1 < dims.size()) {
+            arr[i] = DecodeArrayLevel(env, p, end, dims, level + 1, elemType);
+            continue;
+        }
+        if (p + 4 > end) break;
+        auto elemLen = static_cast<int32_t>(ReadU32(p));
+        p += 4;
+        if (elemLen < 0) {
+            arr[i] = env.Null();
+        } else if (p + elemLen <= end) {
+            arr[i] = DecodeBinary(env, p, elemLen, elemType);
+            p += elemLen;
+        }
+    }
+    return arr;
+}
+
+static Napi::Value DecodeArray(Napi::Env env, const char* data, int len) {
+    if (len < 12) return Napi::Array::New(env);
+    const char* end = data + len;
+    auto ndim = static_cast<int32_t>(ReadU32(data));
+    Oid elemType = ReadU32(data + 8);
+    if (ndim <= 0) return Napi::Array::New(env);
+
+    const char* p = data + 12;
+    std::vector<int32_t> dims;
+    for (int32_t d = 0; d < ndim && p + 8 <= end; ++d, p += 8) {
+        dims.push_back(static_cast<int32_t>(ReadU32(p)));
+    }
+    if (static_cast<int32_t>(dims.size()) != ndim) return Napi::Array::New(env);
+    return DecodeArrayLevel(env, p, end, dims, 0, elemType);
+}
+
+Napi::Value DecodeBinary(Napi::Env env, const char* data, int len, Oid type) {
+    switch (type) {
+        case BOOLOID:
+            return Napi::Boolean::New(env, len > 0 && data[0] != 0);
+        case INT2OID:
+            return Napi::Number::New(env, static_cast<int16_t>(ReadU16(data)));
+        case INT4OID:
+            return Napi::Number::New(env, static_cast<int32_t>(ReadU32(data)));
+        case OIDOID:
+            return Napi::Number::New(env, ReadU32(data));
+        case INT8OID:
+            return Int64Value(env, static_cast<int64_t>(ReadU64(data)));
+        case FLOAT4OID: {
+            uint32_t bits = ReadU32(data);
+            float value;
+            std::memcpy(&value, &bits, sizeof(value));
+            return Napi::Number::New(env, value);
+        }
+        case FLOAT8OID: {
+            uint64_t bits = ReadU64(data);
+            double value;
+            std::memcpy(&value, &bits, sizeof(value));
+            return Napi::Number::New(env, value);
+        }
+        case BYTEAOID:
+            return Napi::Buffer<char>::Copy(env, data, len);
+        case UUIDOID:
+            return Napi::String::New(env, FormatUuid(data));
+        case TIMESTAMPOID:
+        case TIMESTAMPTZOID: {
+            auto micros = static_cast<int64_t>(ReadU64(data));
+            if (micros == std::numeric_limits<int64_t>::max()) return Napi::String::New(env, "infinity");
+            if (micros == std::numeric_limits<int64_t>::min()) return Napi::String::New(env, "-infinity");
+            return Napi::Date::New(env, std::floor(micros / 1000.0) + POSTGRES_EPOCH_MS);
+        }
+        case DATEOID: {
+            auto days = static_cast<int32_t>(ReadU32(data));
+            if (days == std::numeric_limits<int32_t>::max()) return Napi::String::New(env, "infinity");
+            if (days == std::numeric_limits<int32_t>::min()) return Napi::String::New(env, "-infinity");
+            return Napi::String::New(env, FormatDate(days + POSTGRES_EPOCH_DAYS));
+        }
+        case TIMEOID:
+            return Napi::String::New(env, FormatTime(static_cast<int64_t>(ReadU64(data))));
+        case NUMERICOID:
+            return Napi::String::New(env, DecodeNumeric(data, len));
+        case JSONBOID:
+            // Version byte, then the JSON text.
+            return len > 0 ? Napi::String::New(env, data + 1, len - 1) : Napi::String::New(env, "");
+        case TEXTOID:
+        case VARCHAROID:
+        case BPCHAROID:
+        case NAMEOID:
+        case CHAROID:
+        case JSONOID:
+        case XMLOID:
+        case UNKNOWNOID:
+            return Napi::String::New(env, data, len);
+        default:
+            if (IsArrayType(type)) return DecodeArray(env, data, len);
+            return Napi::Buffer<char>::Copy(env, data, len);
+    }
+}
+
+// Column names are interned once per result, and every row is created with
+// all of its properties in a single call. Rows then share one hidden class
+// instead of walking a transition per column.
+template <typename NameAt, typename ValueAt>
+static Napi::Array BuildRows(Napi::Env env, int rowCount, int colCount, NameAt nameAt, ValueAt valueAt) {
+    auto rows = Napi::Array::New(env, rowCount);
+    if (rowCount == 0) return rows;
+
+    std::vector<napi_property_descriptor> props(colCount);
+    for (int j = 0; j < colCount; ++j) {
+        props[j] = napi_property_descriptor{nullptr, Napi::String::New(env, nameAt(j)), nullptr, nullptr,
+                                            nullptr, nullptr, napi_default_jsproperty, nullptr};
+    }
+
+    for (int i = 0; i < rowCount; ++i) {
+        Napi::HandleScope scope(env);
+        for (int j = 0; j < colCount; ++j) {
+            props[j].value = valueAt(i, j);
+        }
+
+        napi_value row;
+        napi_status status = napi_create_object(env, &row);
+        if (status == napi_ok) status = napi_define_properties(env, row, colCount, props.data());
+        NAPI_THROW_IF_FAILED(env, status, rows);
+        rows[i] = Napi::Value(env, row);
+    }
+    return rows;
+}
+
+Napi::Array ConvertResult(Napi::Env env, const PGresult* result) {
+    int rowCount = result ? PQntuples(result) : 0;
+    int colCount = result ? PQnfields(result) : 0;
+    std::vector<Oid> types(colCount);
+    for (int j = 0; j < colCount; ++j) types[j] = PQftype(result, j);
+
+    return BuildRows(env, rowCount, colCount,
+                     [&](int j) { return PQfname(result, j); },
+                     [&](int i, int j) { return FastConvert(env, result, i, j, types[j]); });
+}
+
+Napi::Array ConvertResults(Napi::Env env, const std::vector<PGresult*>& results) {
+    int rowCount = 0;
+    for (auto* res : results) rowCount += PQntuples(res);
+    if (rowCount == 0) return Napi::Array::New(env);
+
+    const PGresult* first = results[0];
+    int colCount = PQnfields(first);
+    std::vector<Oid> types(colCount);
+    for (int j = 0; j < colCount; ++j) types[j] = PQftype(first, j);
+
+    // Rows are visited in order, so walk the results alongside them.
+    size_t which = 0;
+    int base = 0;
+    return BuildRows(env, rowCount, colCount,
+                     [&](int j) { return PQfname(first, j); },
+                     [&](int i, int j) {
+                         while (i - base >= PQntuples(results[which])) base += PQntuples(results[which++]);
+                         return FastConvert(env, results[which], i - base, j, types[j]);
+                     });
+}
+
+// Text-format values that FastConvert makes strings of, and binary-format
+// strings, jsonb, bytea and types without a decoder.
+static bool RawBytes(Oid type, bool binary) {
+    if (!binary) {
+        return type != INT2OID && type != INT4OID && type != INT8OID && type != BOOLOID &&
+               type != FLOAT4OID && type != FLOAT8OID;
+    }
+    switch (type) {
+        case TEXTOID:
+        case VARCHAROID:
+        case BPCHAROID:
+        case NAMEOID:
+        case CHAROID:
+        case JSONOID:
+        case JSONBOID:
+        case XMLOID:
+        case UNKNOWNOID:
+        case BYTEAOID:
+            return true;
+        case BOOLOID:
+        case INT2OID:
+        case INT4OID:
+        case INT8OID:
+        case OIDOID:
+        case FLOAT4OID:
+        case FLOAT8OID:
+        case UUIDOID:
+        case TIMESTAMPOID:
+        case TIMESTAMPTZOID:
+        case DATEOID:
+        case TIMEOID:
+        case NUMERICOID:
+            return false;
+        default:
+            return !IsArrayType(type);
+    }
+}
+
+// Each Buffer holds a reference to the result. Where external buffers are
+// not allowed, the bytes are copied and the reference dropped at once.
+static Napi::Value ResultBytes(Napi::Env env, const std::shared_ptr<PGresult>& owner, const char* data, size_t length) {
+    return Napi::Buffer<char>::NewOrCopy(
+        env, const_cast<char*>(data), length,
+        [](Napi::Env, char*, std::shared_ptr<PGresult>* hold) { delete hold; }, new std::shared_ptr<PGresult>(owner));
+}
+
+Napi::Array ConvertResult(Napi::Env env, PGresult* result, const BufferColumns& buffers) {
+    std::shared_ptr<PGresult> owner(result, PQclear);
+    int rowCount = result ? PQntuples(result) : 0;
+    int colCount = result ? PQnfields(result) : 0;
+    std::vector<Oid> types(colCount);
+    std::vector<bool> raw(colCount);
+    for (int j = 0; j < colCount; ++j) {
+        types[j] = PQftype(result, j);
+        raw[j] = buffers.wants(PQfname(result, j)) && RawBytes(types[j], PQfformat(result, j) == 1);
+    }
+
+    return BuildRows(env, rowCount, colCount,
+                     [&](int j) { return PQfname(result, j); },
+                     [&](int i, int j) -> Napi::Value {
+                         if (!raw[j] || PQgetisnull(result, i, j)) return FastConvert(env, result, i, j, types[j]);
+                         const char* value = PQgetvalue(result, i, j);
+                         size_t length = PQgetlength(result, i, j);
+                         // jsonb's binary form is a version byte followed by the text.
+                         if (types[j] == JSONBOID && PQfformat(result, j) == 1 && length > 0) {
+                             ++value;
+                             --length;
+                         }
+                         return ResultBytes(env, owner, value, length);
+                     });
+}
+
+static Napi::Value CellValue(Napi::Env env, const ResultBuffer& buffer, int row, int col) {
+    using Kind = ResultBuffer::Kind;
+    if (buffer.isNull(row, col)) return env.Null();
+
+    const auto& column = buffer.column(col);
+    const auto& cell = buffer.cell(row, col);
+    switch (column.kind) {
+        case Kind::Bool:
+            return Napi::Boolean::New(env, cell.flag);
+        case Kind::Number:
+            return Napi::Number::New(env, cell.number);
+        case Kind::Int64:
+            return Int64Value(env, cell.integer);
+        case Kind::Timestamp:
+            if (std::isinf(cell.number)) return Napi::String::New(env, cell.number > 0 ? "infinity" : "-infinity");
+            return Napi::Date::New(env, cell.number);
+        case Kind::Text:
+            return Napi::String::New(env, buffer.bytes(cell), cell.bytes.length);
+        default:
+            return DecodeBinary(env, buffer.bytes(cell), static_cast<int>(cell.bytes.length), column.type);
+    }
+}
+
+Napi::Array ConvertResult(Napi::Env env, const ResultBuffer& buffer) {
+    return BuildRows(env, buffer.rowCount(), buffer.columnCount(),
+                     [&](int j) { return buffer.column(j).name; },
+                     [&](int i, int j) { return CellValue(env, buffer, i, j); });
+}
+
+namespace {
+
+class DecodeWorker : public Napi::AsyncWorker {
+public:
+    DecodeWorker(Napi::Env env, Napi::Promise::Deferred deferred, PGresult* result, Decoded decoded)
+        : Napi::AsyncWorker(env, "pgnx:decode"), deferred_(deferred), result_(result), decoded_(std::move(decoded)) {}
+
+    ~DecodeWorker() override {
+        if (result_) PQclear(result_);
+    }
+
+    // A result too large for the buffer's offsets is kept and converted
+    // straight from libpq on the JS thread instead, as it would have been
+    // had it not been offloaded.
+    void Execute() override {
+        try {
+            buffer_ = std::make_unique<ResultBuffer>(result_);
+        } catch (const std::length_error&) {
+            return;
+        } catch (const std::exception& e) {
+            SetError(e.what());
+        }
+        PQclear(result_);
+        result_ = nullptr;
+    }
+
+    void OnOK() override {
+        auto start = std::chrono::steady_clock::now();
+        deferred_.Resolve(buffer_ ? ConvertResult(Env(), *buffer_) : ConvertResult(Env(), result_));
+        if (decoded_) decoded_(std::chrono::steady_clock::now() - start);
+    }
+
+    void OnError(const Napi::Error& error) override {
+        deferred_.Reject(error.Value());
+        if (decoded_) decoded_({});
+    }
+
+private:
+    Napi::Promise::Deferred deferred_;
+    PGresult* result_;
+    std::unique_ptr<ResultBuffer> buffer_;
+    Decoded decoded_;
+};
+
+}  // namespace
+
+void ResolveRows(Napi::Env env, Napi::Promise::Deferred deferred, PGresult* result, Decoded decoded) {
+    (new DecodeWorker(env, deferred, result, std::move(decoded)))->Queue();
+}
@@ -0,0 +1,65 @@
+#pragma once
+#include <napi.h>
+#include <libpq-fe.h>
+#include "pg_types.h"
+#include "result_buffer.h"
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Decodes one value sent in PostgreSQL's binary format. Types without a
+// decoder come back as a Buffer of the raw bytes.
+Napi::Value DecodeBinary(Napi::Env env, const char* data, int len, Oid type);
+
+inline Napi::Value FastConvert(Napi::Env env, const PGresult* res, int row, int col, Oid type) {
+    if (PQgetisnull(res, row, col)) return env.Null();
+
+    const char* value = PQgetvalue(res, row, col);
+    if (PQfformat(res, col) == 1) return DecodeBinary(env, value, PQgetlength(res, row, col), type);
+
+    if (type == INT4OID || type == INT8OID || type == INT2OID) {
+        return Napi::Number::New(env, static_cast<double>(std::strtoll(value, nullptr, 10)));
+    } else if (type == BOOLOID) {
+        return Napi::Boolean::New(env, value[0] == 't');
+    } else if (type == FLOAT4OID || type == FLOAT8OID) {
+        return Napi::Number::New(env, std::strtod(value, nullptr));
+    }
+    return Napi::String::New(env, value, PQgetlength(res, row, col));
+}
+
+// Columns whose values come back as Buffers over the result's own memory
+// instead of strings: every eligible column, or just the named ones.
+struct BufferColumns {
+    bool all = false;
+    std::vector<std::string> names;
+
+    bool wants(const char* name) const {
+        if (all) return true;
+        for (const auto& n : names) {
+            if (n == name) return true;
+        }
+        return false;
+    }
+};
+
+// Converts every row of a result to a plain object keyed by column name.
+Napi::Array ConvertResult(Napi::Env env, const PGresult* result);
+Napi::Array ConvertResult(Napi::Env env, const ResultBuffer& buffer);
+// Concatenates the rows of results that share one column list, e.g. the
+// single-row results of a stream.
+Napi::Array ConvertResults(Napi::Env env, const std::vector<PGresult*>& results);
+// ConvertResult, with the values of `buffers` columns that would be strings
+// or raw bytes handed out as external Buffers without copying. Takes
+// ownership of `result`, which is freed once the last of them is collected.
+Napi::Array ConvertResult(Napi::Env env, PGresult* result, const BufferColumns& buffers);
+
+// Called on the JS thread once a worker-decoded result has settled, with how
+// long building its JS values took there.
+using Decoded = std::function<void(std::chrono::steady_clock::duration)>;
+
+// Resolves `deferred` with ConvertResult of `result`, first decoding it into
+// a ResultBuffer on a worker thread so the JS thread only creates values.
+// Takes ownership of `result`, which is freed on the worker.
+void ResolveRows(Napi::Env env, Napi::Promise::Deferred deferred, PGresult* result, Decoded decoded = nullptr);
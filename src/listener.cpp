@@ -1,41 +1,243 @@
 #include "listener.h"
+#include <algorithm>
+#include <utility>
 
-Listener::Listener(const std::string& connStr, const std::string& channel, Napi::Function callback)
-    : connStr_(connStr), channel_(channel) {
-    tsfn_ = Napi::ThreadSafeFunction::New(callback.Env(), callback, "Listener", 0, 1);
+Listener::Listener(Napi::Env env, const std::string& connStr)
+    : env_(env), connStr_(connStr), backoff_(MIN_BACKOFF) {
+    tsfn_ = Tsfn::New(env, "pgnx:listener", 0, 1, this);
+    tsfn_.Unref(env);
 }
 
 Listener::~Listener() {
     stop();
 }
 
-void Listener::start() {
-    running_ = true;
-    thread_ = std::thread(&Listener::listen, this);
+void Listener::listen(const std::string& channel, Napi::Function callback) {
+    if (stopped_) return;
+    if (callbacks_.empty()) tsfn_.Ref(env_);
+    callbacks_[channel] = Napi::Persistent(callback);
+    want(channel);
+}
+
+void Listener::subscribe(const std::string& channel, Hook hook, Resubscribed resubscribed) {
+    if (stopped_) return;
+    hooks_[channel] = {std::move(hook), std::move(resubscribed)};
+    want(channel);
+}
+
+void Listener::want(const std::string& channel) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        wanted_.insert(channel);
+    }
+
+    if (!started_) {
+        // The loop and its handles exist before the thread does, so wakeups
+        // sent from here are never lost.
+        started_ = true;
+        uv_loop_init(&loop_);
+        uv_async_init(&loop_, &wake_, &Listener::OnWake);
+        uv_timer_init(&loop_, &retry_);
+        wake_.data = this;
+        retry_.data = this;
+        thread_ = std::thread(&Listener::run, this);
+        return;
+    }
+    uv_async_send(&wake_);
+}
+
+void Listener::unlisten(const std::string& channel) {
+    if (callbacks_.erase(channel) == 0) return;
+    // Nothing left to deliver shouldn't keep the process alive.
+    if (callbacks_.empty()) tsfn_.Unref(env_);
+    if (hooks_.count(channel)) return;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        wanted_.erase(channel);
+    }
+    uv_async_send(&wake_);
 }
 
 void Listener::stop() {
-    running_ = false;
-    if (thread_.joinable()) thread_.join();
-    tsfn_.Release();
-}
-
-void Listener::listen() {
-    try {
-        pqxx::connection conn(connStr_);
-        pqxx::work txn(conn);
-        txn.exec("LISTEN " + conn.quote_name(channel_));
-        txn.commit();
-
-        while (running_) {
-            conn.await_notification(100, 0);
-            
-            int count = conn.get_notifs();
-            if (count > 0) {
-                tsfn_.BlockingCall([](Napi::Env env, Napi::Function jsCallback) {
-                    jsCallback.Call({Napi::String::New(env, "notification")});
-                });
-            }
+    if (stopped_) return;
+    stopped_ = true;
+    callbacks_.clear();
+    hooks_.clear();
+
+    if (started_) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        uv_async_send(&wake_);
+        thread_.join();
+        uv_loop_close(&loop_);
+    }
+    // Aborting drops batches still queued for JS, whose callbacks are gone.
+    tsfn_.Abort();
+}
+
+void Listener::Deliver(Napi::Env env, Napi::Function, Listener* listener, Batch* batch) {
+    std::unique_ptr<Batch> owned(batch);
+    if (!env) return;
+
+    if (owned->resubscribed) {
+        for (auto& [channel, sub] : listener->hooks_) {
+            if (sub.resubscribed) sub.resubscribed();
+        }
+    }
+    for (auto& note : owned->notes) {
+        auto hook = listener->hooks_.find(note.channel);
+        if (hook != listener->hooks_.end()) hook->second.hook(note);
+
+        auto it = listener->callbacks_.find(note.channel);
+        if (it == listener->callbacks_.end()) continue;
+
+        auto event = Napi::Object::New(env);
+        event.Set("channel", Napi::String::New(env, note.channel));
+        event.Set("payload", Napi::String::New(env, note.payload));
+        event.Set("pid", Napi::Number::New(env, note.pid));
+        it->second.Call({event});
+        // A throwing callback is reported as uncaught, but the rest of the
+        // batch, cache invalidations included, is still delivered.
+        if (env.IsExceptionPending()) {
+            auto thrown = env.GetAndClearPendingException();
+            napi_fatal_exception(env, thrown.Value());
+        }
+    }
+}
+
+void Listener::run() {
+    connect();
+    uv_run(&loop_, UV_RUN_DEFAULT);
+}
+
+void Listener::OnWake(uv_async_t* handle) {
+    auto* listener = static_cast<Listener*>(handle->data);
+    bool stopping;
+    {
+        std::lock_guard<std::mutex> lock(listener->mutex_);
+        stopping = listener->stopping_;
+    }
+
+    if (!stopping) {
+        // Without a connection, the retry picks up the change.
+        if (listener->conn_) listener->sync();
+        return;
+    }
+
+    listener->disconnect(false);
+    uv_close(reinterpret_cast<uv_handle_t*>(&listener->wake_), nullptr);
+    uv_close(reinterpret_cast<uv_handle_t*>(&listener->retry_), nullptr);
+}
+
+void Listener::OnReadable(uv_poll_t* handle, int status, int) {
+    auto* listener = static_cast<Listener*>(handle->data);
+    if (status < 0 || !PQconsumeInput(listener->conn_)) {
+        listener->disconnect(true);
+        return;
+    }
+    listener->drain();
+}
+
+void Listener::OnRetry(uv_timer_t* handle) {
+    static_cast<Listener*>(handle->data)->connect();
+}
+
+void Listener::connect() {
+    conn_ = PQconnectdb(connStr_.c_str());
+    if (PQstatus(conn_) != CONNECTION_OK) {
+        disconnect(true);
+        return;
+    }
+
+    poll_ = new uv_poll_t();
+    poll_->data = this;
+    if (uv_poll_init_socket(&loop_, poll_, PQsocket(conn_)) != 0) {
+        delete poll_;
+        poll_ = nullptr;
+        disconnect(true);
+        return;
+    }
+    uv_poll_start(poll_, UV_READABLE, &Listener::OnReadable);
+
+    backoff_ = MIN_BACKOFF;
+    active_.clear();
+    fresh_ = true;
+    sync();
+}
+
+// Brings the connection's LISTENs in line with what JS wants. The commands
+// block this thread only, and notifications that arrive meanwhile are
+// buffered by libpq and picked up by drain().
+void Listener::sync() {
+    std::set<std::string> wanted;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        wanted = wanted_;
+    }
+
+    std::vector<std::pair<std::string, bool>> changes;
+    for (const auto& channel : wanted) {
+        if (!active_.count(channel)) changes.emplace_back(channel, true);
+    }
+    for (const auto& channel : active_) {
+        if (!wanted.count(channel)) changes.emplace_back(channel, false);
+    }
+
+    for (const auto& [channel, subscribe] : changes) {
+        char* name = PQescapeIdentifier(conn_, channel.data(), channel.size());
+        if (!name) {
+            disconnect(true);
+            return;
+        }
+        std::string sql = (subscribe ? "LISTEN " : "UNLISTEN ") + std::string(name);
+        PQfreemem(name);
+
+        PGresult* res = PQexec(conn_, sql.c_str());
+        bool ok = PQresultStatus(res) == PGRES_COMMAND_OK;
+        PQclear(res);
+        if (!ok) {
+            disconnect(true);
+            return;
+        }
+        if (subscribe) {
+            active_.insert(channel);
+        } else {
+            active_.erase(channel);
         }
-    } catch (...) {}
+    }
+    drain(std::exchange(fresh_, false));
+}
+
+void Listener::drain(bool resubscribed) {
+    auto batch = std::make_unique<Batch>();
+    batch->resubscribed = resubscribed;
+    while (PGnotify* note = PQnotifies(conn_)) {
+        batch->notes.push_back({note->relname, note->extra ? note->extra : "", note->be_pid});
+        PQfreemem(note);
+    }
+    if (batch->notes.empty() && !resubscribed) return;
+    if (tsfn_.NonBlockingCall(batch.get()) == napi_ok) batch.release();
+}
+
+void Listener::disconnect(bool retry) {
+    if (poll_) {
+        // The socket stays open until the handle has finished closing.
+        uv_poll_stop(poll_);
+        poll_->data = conn_;
+        uv_close(reinterpret_cast<uv_handle_t*>(poll_), [](uv_handle_t* handle) {
+            PQfinish(static_cast<PGconn*>(handle->data));
+            delete reinterpret_cast<uv_poll_t*>(handle);
+        });
+        poll_ = nullptr;
+    } else if (conn_) {
+        PQfinish(conn_);
+    }
+    conn_ = nullptr;
+    active_.clear();
+
+    if (!retry) return;
+    uv_timer_start(&retry_, &Listener::OnRetry, backoff_.count(), 0);
+    backoff_ = std::min(backoff_ * 2, MAX_BACKOFF);
 }
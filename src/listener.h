@@ -1,24 +1,93 @@
 #pragma once
 #include <napi.h>
-#include <pqxx/pqxx>
-#include <thread>
+#include <uv.h>
+#include <libpq-fe.h>
 #include <chrono>
-#include <atomic>
-#include <string>
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
+// One dedicated connection LISTENing on every subscribed channel. It runs its
+// own libuv loop on a background thread that wakes on the socket rather than
+// polling, and hands each wakeup's notifications to JS in a single call. A
+// dropped connection is reopened with backoff and every channel LISTENed
+// again.
 class Listener {
 public:
-    Listener(const std::string& connStr, const std::string& channel, Napi::Function callback);
+    struct Notification {
+        std::string channel;
+        std::string payload;
+        int pid;
+    };
+    // What one wakeup hands to JS. `resubscribed` is set when a new
+    // connection has just LISTENed again, having missed anything sent while
+    // there was none.
+    struct Batch {
+        std::vector<Notification> notes;
+        bool resubscribed = false;
+    };
+    using Hook = std::function<void(const Notification&)>;
+    using Resubscribed = std::function<void()>;
+
+    Listener(Napi::Env env, const std::string& connStr);
     ~Listener();
-    void start();
+
+    // Main thread only. listen() replaces any callback already on `channel`.
+    void listen(const std::string& channel, Napi::Function callback);
+    void unlisten(const std::string& channel);
+    // A native subscription that unlisten() leaves alone. It never keeps the
+    // process alive on its own. `resubscribed` runs after every (re)connect.
+    void subscribe(const std::string& channel, Hook hook, Resubscribed resubscribed = nullptr);
     void stop();
 
 private:
-    void listen();
+    static void Deliver(Napi::Env env, Napi::Function, Listener* listener, Batch* batch);
+    using Tsfn = Napi::TypedThreadSafeFunction<Listener, Batch, &Listener::Deliver>;
+
+    static void OnWake(uv_async_t* handle);
+    static void OnReadable(uv_poll_t* handle, int status, int events);
+    static void OnRetry(uv_timer_t* handle);
+
+    // Listener thread only.
+    void run();
+    void connect();
+    void sync();
+    void drain(bool resubscribed = false);
+    void disconnect(bool retry);
+    void want(const std::string& channel);
+
+    Napi::Env env_;
     std::string connStr_;
-    std::string channel_;
-    Napi::ThreadSafeFunction tsfn_;
+    std::unordered_map<std::string, Napi::FunctionReference> callbacks_;
+    struct Subscription {
+        Hook hook;
+        Resubscribed resubscribed;
+    };
+    std::unordered_map<std::string, Subscription> hooks_;
+    Tsfn tsfn_;
+    bool started_ = false;
+    bool stopped_ = false;
+
+    std::mutex mutex_;
+    std::set<std::string> wanted_;
+    bool stopping_ = false;
+
+    uv_loop_t loop_;
+    uv_async_t wake_;
+    uv_timer_t retry_;
+    uv_poll_t* poll_ = nullptr;
+    PGconn* conn_ = nullptr;
+    std::set<std::string> active_;
+    // Connected, but the LISTENs haven't all been sent yet.
+    bool fresh_ = false;
+    std::chrono::milliseconds backoff_;
     std::thread thread_;
-    std::atomic<bool> running_{false};
+
+    static constexpr std::chrono::milliseconds MIN_BACKOFF{100};
+    static constexpr std::chrono::milliseconds MAX_BACKOFF{10000};
 };
@@ -0,0 +1,103 @@
+#include "metrics.h"
+#include <algorithm>
+#include <cctype>
+
+void LatencyHistogram::record(std::chrono::steady_clock::duration elapsed) {
+    auto micros = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+    uint64_t value = micros > 0 ? static_cast<uint64_t>(micros) : 0;
+    value = std::min(value, (uint64_t(1) << MAX_BIT) - 1);
+
+    buckets_[bucketOf(value)]++;
+    count_++;
+    sumMicros_ += value;
+    maxMicros_ = std::max(maxMicros_, value);
+}
+
+// Values below SUB_BUCKETS get a bucket each; above that, the top SUB_BITS
+// bits after the leading one pick the sub-bucket.
+int LatencyHistogram::bucketOf(uint64_t micros) {
+    if (micros < SUB_BUCKETS) return static_cast<int>(micros);
+    int top = 63 - __builtin_clzll(micros);
+    int shift = top - SUB_BITS;
+    return (shift + 1) * SUB_BUCKETS + static_cast<int>((micros >> shift) & (SUB_BUCKETS - 1));
+}
+
+uint64_t LatencyHistogram::bucketTop(int bucket) {
+    if (bucket < SUB_BUCKETS) return bucket;
+    int shift = bucket / SUB_BUCKETS - 1;
+    uint64_t low = uint64_t(SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+    return low + (uint64_t(1) << shift) - 1;
+}
+
+double LatencyHistogram::percentileMs(double q) const {
+    if (count_ == 0) return 0;
+    auto rank = static_cast<uint64_t>(std::clamp(q, 0.0, 1.0) * (count_ - 1)) + 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < BUCKETS; ++i) {
+        seen += buckets_[i];
+        if (seen >= rank) return std::min(bucketTop(i), maxMicros_) / 1000.0;
+    }
+    return maxMs();
+}
+
+// Strings, numbers and dollar-quoted bodies become '?' and -- comments are
+// dropped; identifiers and $n placeholders are kept.
+std::string Fingerprint(const std::string& sql) {
+    std::string out;
+    out.reserve(sql.size());
+    auto isWord = [](char c) { return std::isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '$'; };
+
+    size_t i = 0;
+    while (i < sql.size()) {
+        char c = sql[i];
+        if (std::isspace(static_cast<unsigned char>(c))) {
+            while (i < sql.size() && std::isspace(static_cast<unsigned char>(sql[i]))) ++i;
+            if (!out.empty() && out.back() != ' ') out += ' ';
+            continue;
+        }
+        if (c == '-' && i + 1 < sql.size() && sql[i + 1] == '-') {
+            while (i < sql.size() && sql[i] != '\n') ++i;
+            continue;
+        }
+        if (c == '\'') {
+            // '' is an escaped quote inside the literal.
+            for (++i; i < sql.size(); ++i) {
+                if (sql[i] != '\'') continue;
+                if (i + 1 < sql.size() && sql[i + 1] == '\'') {
+                    ++i;
+                    continue;
+                }
+                break;
+            }
+            ++i;
+            out += '?';
+            continue;
+        }
+        if (c == '$' && (out.empty() || !isWord(out.back()))) {
+            // $tag$ ... $tag$, unless it is a $n placeholder.
+            size_t end = i + 1;
+            while (end < sql.size() && (std::isalnum(static_cast<unsigned char>(sql[end])) || sql[end] == '_')) ++end;
+            bool placeholder = end > i + 1 && std::all_of(sql.begin() + i + 1, sql.begin() + end,
+                                                          [](char d) { return std::isdigit(static_cast<unsigned char>(d)); });
+            if (!placeholder && end < sql.size() && sql[end] == '$') {
+                std::string tag = sql.substr(i, end - i + 1);
+                size_t close = sql.find(tag, end + 1);
+                i = close == std::string::npos ? sql.size() : close + tag.size();
+                out += '?';
+                continue;
+            }
+            out.append(sql, i, end - i);
+            i = end;
+            continue;
+        }
+        if (std::isdigit(static_cast<unsigned char>(c)) && (out.empty() || !isWord(out.back()))) {
+            while (i < sql.size() && (std::isalnum(static_cast<unsigned char>(sql[i])) || sql[i] == '.')) ++i;
+            out += '?';
+            continue;
+        }
+        out += c;
+        ++i;
+    }
+    while (!out.empty() && out.back() == ' ') out.pop_back();
+    return out;
+}
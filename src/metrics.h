@@ -0,0 +1,58 @@
+#pragma once
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// Latency histogram in the style of HdrHistogram: every power of two of
+// microseconds is split into 16 linear sub-buckets, so percentiles are
+// within about 6% of the true value. Recording is a handful of integer ops
+// and never allocates. Not synchronized; owners lock if they need to.
+class LatencyHistogram {
+public:
+    void record(std::chrono::steady_clock::duration elapsed);
+
+    uint64_t count() const { return count_; }
+    double meanMs() const { return count_ ? sumMicros_ / 1000.0 / count_ : 0; }
+    double maxMs() const { return maxMicros_ / 1000.0; }
+    // Upper bound of the bucket holding the q-th quantile, 0 <= q <= 1.
+    double percentileMs(double q) const;
+
+private:
+    static constexpr int SUB_BITS = 4;
+    static constexpr int SUB_BUCKETS = 1 << SUB_BITS;
+    // Values are capped at 2^40 us, about 12 days.
+    static constexpr int MAX_BIT = 40;
+    static constexpr int BUCKETS = (MAX_BIT - SUB_BITS + 1) * SUB_BUCKETS;
+
+    static int bucketOf(uint64_t micros);
+    static uint64_t bucketTop(int bucket);
+
+    std::array<uint64_t, BUCKETS> buckets_{};
+    uint64_t count_ = 0;
+    uint64_t sumMicros_ = 0;
+    uint64_t maxMicros_ = 0;
+};
+
+// What the query engine records for every query it settles. Updated on the
+// JS thread only.
+struct QueryMetrics {
+    uint64_t queries = 0;
+    uint64_t errors = 0;
+    uint64_t rows = 0;
+    uint64_t bytes = 0;
+    uint64_t slowQueries = 0;
+    // Answered from the result cache.
+    uint64_t cached = 0;
+    // Queued until a connection (or a pinned client's turn) came up.
+    LatencyHistogram acquire;
+    // From sending the query to its last result arriving.
+    LatencyHistogram execute;
+    // Turning results into JS values on the JS thread.
+    LatencyHistogram decode;
+    LatencyHistogram total;
+};
+
+// The SQL with literals replaced by '?' and whitespace collapsed, so every
+// run of the same statement shape reports alike.
+std::string Fingerprint(const std::string& sql);
@@ -0,0 +1,158 @@
+#include "params.h"
+#include "pg_types.h"
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+static std::string BigEndian(uint64_t value, int bytes) {
+    std::string out(bytes, '\0');
+    for (int i = bytes - 1; i >= 0; --i) {
+        out[i] = static_cast<char>(value & 0xff);
+        value >>= 8;
+    }
+    return out;
+}
+
+static bool IsInteger(double value) {
+    return std::isfinite(value) && std::trunc(value) == value && std::fabs(value) < 9.2e18;
+}
+
+// Shortest text that reads back as the same double, so nothing is truncated.
+static std::string FormatNumber(double value) {
+    if (std::isnan(value)) return "NaN";
+    if (std::isinf(value)) return value > 0 ? "Infinity" : "-Infinity";
+    if (IsInteger(value)) return std::to_string(static_cast<long long>(value));
+
+    char buf[32];
+    for (int precision = 15; precision <= 17; ++precision) {
+        std::snprintf(buf, sizeof(buf), "%.*g", precision, value);
+        if (std::strtod(buf, nullptr) == value) break;
+    }
+    return buf;
+}
+
+static std::string FormatTimestamp(double ms) {
+    if (!std::isfinite(ms)) return "Invalid Date";
+
+    auto whole = static_cast<int64_t>(std::floor(ms));
+    int64_t days = whole >= 0 ? whole / 86400000 : (whole - 86399999) / 86400000;
+    int64_t rem = whole - days * 86400000;
+
+    char buf[48];
+    std::snprintf(buf, sizeof(buf), "%s %02d:%02d:%02d.%03d+00", FormatDate(days).c_str(),
+                  static_cast<int>(rem / 3600000), static_cast<int>(rem / 60000 % 60),
+                  static_cast<int>(rem / 1000 % 60), static_cast<int>(rem % 1000));
+    return buf;
+}
+
+static std::string JsonStringify(const Napi::Value& value) {
+    auto env = value.Env();
+    auto json = env.Global().Get("JSON").As<Napi::Object>();
+    auto result = json.Get("stringify").As<Napi::Function>().Call(json, {value});
+    return result.IsString() ? result.As<Napi::String>().Utf8Value() : std::string("null");
+}
+
+static std::string ArrayLiteral(const Napi::Array& arr);
+
+static void AppendArrayElement(std::string& out, const Napi::Value& val) {
+    if (val.IsNull() || val.IsUndefined()) {
+        out += "NULL";
+        return;
+    }
+    if (val.IsArray()) {
+        out += ArrayLiteral(val.As<Napi::Array>());
+        return;
+    }
+
+    std::string text;
+    if (val.IsNumber()) {
+        text = FormatNumber(val.As<Napi::Number>().DoubleValue());
+    } else if (val.IsBoolean()) {
+        text = val.As<Napi::Boolean>().Value() ? "true" : "false";
+    } else if (val.IsDate()) {
+        text = FormatTimestamp(val.As<Napi::Date>().ValueOf());
+    } else if (val.IsString() || val.IsBigInt()) {
+        text = val.ToString().Utf8Value();
+    } else {
+        text = JsonStringify(val);
+    }
+
+    out += '"';
+    for (char c : text) {
+        if (c == '"' || c == '\\') out += '\\';
+        out += c;
+    }
+    out += '"';
+}
+
+static std::string ArrayLiteral(const Napi::Array& arr) {
+    std::string out = "{";
+    uint32_t len = arr.Length();
+    for (uint32_t i = 0; i < len; ++i) {
+        if (i > 0) out += ',';
+        AppendArrayElement(out, arr.Get(i));
+    }
+    out += '}';
+    return out;
+}
+
+QueryParams ReadParams(const Napi::Value& value, bool binary) {
+    QueryParams params;
+    if (!value.IsArray()) return params;
+
+    auto arr = value.As<Napi::Array>();
+    uint32_t len = arr.Length();
+    params.values.reserve(len);
+    for (uint32_t i = 0; i < len; ++i) {
+        auto val = arr.Get(i);
+        if (val.IsNull() || val.IsUndefined()) {
+            params.addNull();
+        } else if (val.IsString()) {
+            params.addText(val.As<Napi::String>().Utf8Value());
+        } else if (val.IsNumber()) {
+            double num = val.As<Napi::Number>().DoubleValue();
+            // Integers go untyped, as in text mode, so the server picks int4,
+            // int8 or text from context; binary int8 would rule out int4-only
+            // functions and operators.
+            if (!binary || IsInteger(num)) {
+                params.addText(FormatNumber(num));
+            } else {
+                uint64_t bits;
+                std::memcpy(&bits, &num, sizeof(bits));
+                params.addBinary(FLOAT8OID, BigEndian(bits, 8));
+            }
+        } else if (val.IsBoolean()) {
+            bool flag = val.As<Napi::Boolean>().Value();
+            if (binary) {
+                params.addBinary(BOOLOID, std::string(1, flag ? '\1' : '\0'));
+            } else {
+                params.addText(flag ? "true" : "false");
+            }
+        } else if (val.IsBigInt()) {
+            bool lossless;
+            int64_t num = val.As<Napi::BigInt>().Int64Value(&lossless);
+            if (binary && lossless) {
+                params.addBinary(INT8OID, BigEndian(static_cast<uint64_t>(num), 8));
+            } else {
+                params.addText(val.ToString().Utf8Value());
+            }
+        } else if (val.IsBuffer()) {
+            auto buf = val.As<Napi::Buffer<char>>();
+            params.addBinary(BYTEAOID, std::string(buf.Data(), buf.Length()));
+        } else if (val.IsDate()) {
+            double ms = val.As<Napi::Date>().ValueOf();
+            if (binary && std::isfinite(ms)) {
+                auto micros = static_cast<int64_t>(std::floor(ms)) * 1000 - POSTGRES_EPOCH_MS * 1000;
+                params.addBinary(TIMESTAMPTZOID, BigEndian(static_cast<uint64_t>(micros), 8));
+            } else {
+                params.addText(FormatTimestamp(ms));
+            }
+        } else if (val.IsArray()) {
+            params.addText(ArrayLiteral(val.As<Napi::Array>()));
+        } else {
+            params.addText(JsonStringify(val));
+        }
+    }
+    return params;
+}
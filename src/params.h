@@ -0,0 +1,63 @@
+#pragma once
+#include <napi.h>
+#include <libpq-fe.h>
+#include <string>
+#include <vector>
+
+// Query parameters ready for PQsendQueryParams. Each value carries its own
+// format: text (0) with an inferred type, or binary (1) with an explicit OID.
+struct QueryParams {
+    std::vector<std::string> values;
+    std::vector<Oid> types;
+    std::vector<int> formats;
+    std::vector<char> nulls;
+
+    bool empty() const { return values.empty(); }
+    int size() const { return static_cast<int>(values.size()); }
+
+    void addNull() { add(std::string(), 0, 0, true); }
+    void addText(std::string value) { add(std::move(value), 0, 0, false); }
+    void addBinary(Oid type, std::string bytes) { add(std::move(bytes), type, 1, false); }
+
+    std::vector<const char*> pointers() const {
+        std::vector<const char*> ptrs;
+        ptrs.reserve(values.size());
+        for (size_t i = 0; i < values.size(); ++i) ptrs.push_back(nulls[i] ? nullptr : values[i].data());
+        return ptrs;
+    }
+
+    std::vector<int> lengths() const {
+        std::vector<int> lens;
+        lens.reserve(values.size());
+        for (const auto& v : values) lens.push_back(static_cast<int>(v.size()));
+        return lens;
+    }
+
+    // NULL when every value is text, which lets libpq skip the arrays.
+    const Oid* typeData() const { return typed_ ? types.data() : nullptr; }
+    const int* formatData() const { return typed_ ? formats.data() : nullptr; }
+
+    // Distinguishes server-side statements prepared for different parameter types.
+    std::string signature() const {
+        if (!typed_) return std::string();
+        std::string sig;
+        for (Oid type : types) sig += "," + std::to_string(type);
+        return sig;
+    }
+
+private:
+    void add(std::string value, Oid type, int format, bool null) {
+        values.push_back(std::move(value));
+        types.push_back(type);
+        formats.push_back(format);
+        nulls.push_back(null);
+        typed_ = typed_ || type != 0;
+    }
+
+    bool typed_ = false;
+};
+
+// Marshals a JS array of parameters. null/undefined become SQL NULL and
+// Buffers are always sent as binary bytea; with `binary` set, numbers,
+// booleans, BigInts and Dates are sent in binary too.
+QueryParams ReadParams(const Napi::Value& value, bool binary = false);
@@ -0,0 +1,101 @@
+#pragma once
+#include <libpq-fe.h>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+// Built-in type OIDs. catalog/pg_type_d.h is a server header, so the ones we
+// decode are spelled out here under the server's names.
+constexpr Oid BOOLOID = 16;
+constexpr Oid BYTEAOID = 17;
+constexpr Oid CHAROID = 18;
+constexpr Oid NAMEOID = 19;
+constexpr Oid INT8OID = 20;
+constexpr Oid INT2OID = 21;
+constexpr Oid INT4OID = 23;
+constexpr Oid TEXTOID = 25;
+constexpr Oid OIDOID = 26;
+constexpr Oid JSONOID = 114;
+constexpr Oid XMLOID = 142;
+constexpr Oid FLOAT4OID = 700;
+constexpr Oid FLOAT8OID = 701;
+constexpr Oid UNKNOWNOID = 705;
+constexpr Oid BPCHAROID = 1042;
+constexpr Oid VARCHAROID = 1043;
+constexpr Oid DATEOID = 1082;
+constexpr Oid TIMEOID = 1083;
+constexpr Oid TIMESTAMPOID = 1114;
+constexpr Oid TIMESTAMPTZOID = 1184;
+constexpr Oid NUMERICOID = 1700;
+constexpr Oid UUIDOID = 2950;
+constexpr Oid JSONBOID = 3802;
+
+inline bool IsArrayType(Oid type) {
+    switch (type) {
+        case 199:   // json[]
+        case 1000:  // bool[]
+        case 1001:  // bytea[]
+        case 1002:  // char[]
+        case 1003:  // name[]
+        case 1005:  // int2[]
+        case 1007:  // int4[]
+        case 1009:  // text[]
+        case 1014:  // bpchar[]
+        case 1015:  // varchar[]
+        case 1016:  // int8[]
+        case 1021:  // float4[]
+        case 1022:  // float8[]
+        case 1028:  // oid[]
+        case 1115:  // timestamp[]
+        case 1182:  // date[]
+        case 1183:  // time[]
+        case 1185:  // timestamptz[]
+        case 1231:  // numeric[]
+        case 2951:  // uuid[]
+        case 3807:  // jsonb[]
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Binary-format values are big-endian.
+inline uint16_t ReadU16(const char* p) {
+    auto b = reinterpret_cast<const unsigned char*>(p);
+    return static_cast<uint16_t>((b[0] << 8) | b[1]);
+}
+
+inline uint32_t ReadU32(const char* p) {
+    auto b = reinterpret_cast<const unsigned char*>(p);
+    return (uint32_t(b[0]) << 24) | (uint32_t(b[1]) << 16) | (uint32_t(b[2]) << 8) | uint32_t(b[3]);
+}
+
+inline uint64_t ReadU64(const char* p) {
+    return (uint64_t(ReadU32(p)) << 32) | ReadU32(p + 4);
+}
+
+// 2000-01-01, the PostgreSQL epoch, relative to the Unix epoch.
+constexpr int64_t POSTGRES_EPOCH_DAYS = 10957;
+constexpr int64_t POSTGRES_EPOCH_MS = POSTGRES_EPOCH_DAYS * 86400000LL;
+
+// Days since 1970-01-01 to a proleptic Gregorian date (H. Hinnant's algorithm).
+inline void CivilFromDays(int64_t days, int64_t& y, unsigned& m, unsigned& d) {
+    days += 719468;
+    int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+    unsigned doe = static_cast<unsigned>(days - era * 146097);
+    unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    unsigned mp = (5 * doy + 2) / 153;
+    d = doy - (153 * mp + 2) / 5 + 1;
+    m = mp < 10 ? mp + 3 : mp - 9;
+    y = static_cast<int64_t>(yoe) + era * 400 + (m <= 2);
+}
+
+inline std::string FormatDate(int64_t unixDays) {
+    int64_t y;
+    unsigned m, d;
+    CivilFromDays(unixDays, y, m, d);
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), "%04lld-%02u-%02u", static_cast<long long>(y), m, d);
+    return buf;
+}
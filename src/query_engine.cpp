@@ -0,0 +1,1701 @@
+#include "query_engine.h"
+#include "convert.h"
+#include "columnar.h"
+#include <algorithm>
+#include <cstdlib>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+
+static std::string TrimMessage(const char* msg) {
+    std::string s = msg ? msg : "";
+    while (!s.empty() && (s.back() == '\n' || s.back() == ' ')) s.pop_back();
+    return s;
+}
+
+std::string ResultError(const PGresult* res) {
+    auto msg = TrimMessage(PQresultErrorMessage(res));
+    return msg.empty() ? "Query failed" : msg;
+}
+
+std::string ConnectionError(PGconn* conn) {
+    auto msg = TrimMessage(PQerrorMessage(conn));
+    return msg.empty() ? "Connection lost" : msg;
+}
+
+QueryEngine::QueryEngine(Napi::Env env, std::shared_ptr<ConnectionPool> pool, EngineOptions options,
+                         std::shared_ptr<ReplicaSet> replicas)
+    : env_(env), loop_(nullptr), pool_(std::move(pool)), replicas_(std::move(replicas)), options_(options),
+      context_(env, "pgnx:query") {
+    napi_get_uv_event_loop(env, &loop_);
+    if (options_.cacheMaxBytes > 0) cache_ = std::make_unique<ResultCache>(options_.cacheMaxBytes, options_.cacheTtl);
+
+    mailbox_ = std::make_shared<Mailbox>();
+    mailbox_->engine = this;
+    mailbox_->self = mailbox_;
+    mailbox_->async.data = mailbox_.get();
+    uv_async_init(loop_, &mailbox_->async, &QueryEngine::OnGrant);
+    uv_unref(reinterpret_cast<uv_handle_t*>(&mailbox_->async));
+
+    timer_ = new uv_timer_t();
+    timer_->data = this;
+    uv_timer_init(loop_, timer_);
+    uv_unref(reinterpret_cast<uv_handle_t*>(timer_));
+
+    batchTimer_ = new uv_timer_t();
+    batchTimer_->data = this;
+    uv_timer_init(loop_, batchTimer_);
+
+    deadlineTimer_ = new uv_timer_t();
+    deadlineTimer_->data = this;
+    uv_timer_init(loop_, deadlineTimer_);
+    uv_unref(reinterpret_cast<uv_handle_t*>(deadlineTimer_));
+
+    settleCheck_ = new uv_check_t();
+    settleCheck_->data = this;
+    uv_check_init(loop_, settleCheck_);
+    settleIdle_ = new uv_idle_t();
+    uv_idle_init(loop_, settleIdle_);
+}
+
+QueryEngine::~QueryEngine() {
+    std::vector<Grant> grants;
+    {
+        std::lock_guard<std::mutex> lock(mailbox_->mutex);
+        mailbox_->closed = true;
+        grants.swap(mailbox_->grants);
+    }
+    for (auto& grant : grants) {
+        if (grant.pool) grant.pool->release(std::move(grant.conn));
+    }
+
+    uv_close(reinterpret_cast<uv_handle_t*>(&mailbox_->async), [](uv_handle_t* handle) {
+        auto keep = std::move(static_cast<Mailbox*>(handle->data)->self);
+    });
+    for (auto* timer : {timer_, batchTimer_, deadlineTimer_}) {
+        uv_close(reinterpret_cast<uv_handle_t*>(timer), [](uv_handle_t* handle) {
+            delete reinterpret_cast<uv_timer_t*>(handle);
+        });
+    }
+    dropCompleted();
+    uv_close(reinterpret_cast<uv_handle_t*>(settleCheck_), [](uv_handle_t* handle) {
+        delete reinterpret_cast<uv_check_t*>(handle);
+    });
+    uv_close(reinterpret_cast<uv_handle_t*>(settleIdle_), [](uv_handle_t* handle) {
+        delete reinterpret_cast<uv_idle_t*>(handle);
+    });
+}
+
+// Most auto-batched queries are sent in pipeline mode, which only speaks the
+// extended protocol. Any SQL containing ';' might be several statements, so
+// it is never batched.
+static bool Batchable(const QueryOp& op) {
+    return op.statements.size() == 1 && !op.pipeline && !op.stream && !op.copy && !op.session && !op.cancel &&
+           op.statements[0].sql.find(';') == std::string::npos;
+}
+
+// Past this many queued queries the batch goes out without waiting for the window.
+static constexpr size_t MAX_AUTO_BATCH = 128;
+
+Napi::Promise QueryEngine::submit(std::unique_ptr<QueryOp> op) {
+    auto promise = op->deferred.Promise();
+    op->submittedAt = std::chrono::steady_clock::now();
+
+    if (closed_) {
+        abandon(*op, "Connection closed");
+        return promise;
+    }
+    if (op->statements.empty()) {
+        std::vector<PGresult*> none;
+        settle(*op, none, {});
+        return promise;
+    }
+    // A pinned client's queries run on its primary connection.
+    if (!replicas_ || op->session) op->readOnly = false;
+
+    if (op->cache) {
+        // Pinned clients may be inside a transaction, so they always go to
+        // the server. Cached rows are decoded, so Buffer columns can't come
+        // from them.
+        if (!cache_ || op->session || op->rowMode != RowMode::Objects || op->buffers) {
+            op->cache.reset();
+        } else {
+            const auto& stmt = op->statements.front();
+            op->cache->key = ResultCache::key(stmt.sql, stmt.params, op->binary);
+            if (auto rows = cache_->find(op->cache->key)) {
+                auto decodeStart = std::chrono::steady_clock::now();
+                op->deferred.Resolve(ConvertResult(env_, *rows));
+                auto hit = sampleOf(*op, rows->rowCount(), 0, {});
+                hit.cached = true;
+                record(hit, std::chrono::steady_clock::now() - decodeStart);
+                return promise;
+            }
+            op->cache->generation = cache_->generation();
+        }
+    }
+    if (op->cancel && !arm(*op)) {
+        std::vector<PGresult*> none;
+        settle(*op, none, {});
+        return promise;
+    }
+
+    notePrepareCandidates(*op);
+    if (op->session) {
+        // A pinned client's queries skip the pool and wait their turn on its
+        // connection.
+        auto& session = *op->session;
+        auto* task = session.released ? nullptr : findTask(&session);
+        if (!task) {
+            abandon(*op, session.error.empty() ? "Client has been released" : session.error);
+        } else if (task->op) {
+            session.queue.push_back(std::move(op));
+        } else {
+            run(task, std::move(op));
+        }
+        return promise;
+    }
+
+    if (options_.autoBatch && Batchable(*op)) {
+        // A batch runs on one connection, so reads and writes, or interactive
+        // and batch work, don't share one.
+        if (!batch_.empty() && (batch_.front()->readOnly != op->readOnly || batch_.front()->priority != op->priority)) {
+            flushBatch();
+        }
+        batch_.push_back(std::move(op));
+        if (batch_.size() >= MAX_AUTO_BATCH) {
+            flushBatch();
+        } else if (batch_.size() == 1) {
+            // Timers tick in milliseconds; a zero window still waits for the
+            // rest of the current tick.
+            uint64_t delay = (options_.batchWindowMicros + 999) / 1000;
+            uv_timer_start(batchTimer_, &QueryEngine::OnBatchTimer, delay, 0);
+        }
+        return promise;
+    }
+
+    op->queuedAt = std::chrono::steady_clock::now();
+    lane(op->readOnly, op->priority).pending.push_back(std::move(op));
+    dispatch();
+    return promise;
+}
+
+void QueryEngine::OnBatchTimer(uv_timer_t* handle) {
+    auto engine = static_cast<QueryEngine*>(handle->data)->shared_from_this();
+    Napi::HandleScope scope(engine->env_);
+    Napi::CallbackScope callbackScope(engine->env_, engine->context_);
+    engine->flushBatch();
+}
+
+// Sends the queued queries as one isolated pipeline on a single connection,
+// so one failing query doesn't take the others down with it.
+void QueryEngine::flushBatch() {
+    uv_timer_stop(batchTimer_);
+    if (batch_.empty()) return;
+
+    std::unique_ptr<QueryOp> op;
+    if (batch_.size() == 1) {
+        op = std::move(batch_.front());
+    } else {
+        op = std::make_unique<QueryOp>(env_);
+        op->pipeline = true;
+        op->isolate = true;
+        op->binary = batch_.front()->binary;
+        op->readOnly = batch_.front()->readOnly;
+        op->priority = batch_.front()->priority;
+        op->statements.reserve(batch_.size());
+        for (auto& member : batch_) op->statements.push_back(std::move(member->statements.front()));
+        op->batch = std::move(batch_);
+    }
+    batch_.clear();
+
+    op->queuedAt = std::chrono::steady_clock::now();
+    lane(op->readOnly, op->priority).pending.push_back(std::move(op));
+    dispatch();
+}
+
+Napi::Promise QueryEngine::connect(const std::shared_ptr<Session>& session) {
+    auto op = std::make_unique<QueryOp>(env_);
+    op->session = session;
+    auto promise = op->deferred.Promise();
+
+    if (closed_) {
+        abandon(*op, "Connection closed");
+        return promise;
+    }
+
+    op->queuedAt = std::chrono::steady_clock::now();
+    lane(false, Priority::Interactive).pending.push_back(std::move(op));
+    dispatch();
+    return promise;
+}
+
+void QueryEngine::release(const std::shared_ptr<Session>& session, bool discard) {
+    if (session->released) return;
+    session->released = true;
+    session->discard = discard;
+
+    // With a query still running, complete() unpins once the queue drains.
+    auto* task = findTask(session.get());
+    if (!task || task->op) return;
+    unpin(task);
+    dispatch();
+}
+
+// query() text only earns a server-side statement once it has been seen
+// twice; one-off SQL keeps going out unnamed.
+void QueryEngine::notePrepareCandidates(QueryOp& op) {
+    for (auto& stmt : op.statements) {
+        if (stmt.prepare != PrepareMode::Auto) continue;
+        if (options_.statementCacheSize == 0) {
+            stmt.prepare = PrepareMode::None;
+            continue;
+        }
+        if (sightings_.size() >= options_.statementCacheSize * 8) sightings_.clear();
+        if (++sightings_[stmt.sql] < 2) stmt.prepare = PrepareMode::None;
+    }
+}
+
+void QueryEngine::dispatch() {
+    bool requested = false;
+    for (auto& lane : lanes_) {
+        if (lane.readOnly && !replicas_) continue;
+        dispatch(lane);
+        requested = requested || !lane.requests.empty();
+    }
+
+    // Outstanding requests keep the loop alive until they are granted.
+    auto* async = reinterpret_cast<uv_handle_t*>(&mailbox_->async);
+    if (!requested) {
+        uv_unref(async);
+    } else {
+        uv_ref(async);
+    }
+    armTimer();
+}
+
+void QueryEngine::dispatch(Lane& lane) {
+    while (!lane.pending.empty()) {
+        int host = lane.readOnly ? replicas_->pick() : -1;
+        auto pool = host < 0 ? pool_ : replicas_->pool(host);
+        auto conn = pool->tryAcquire(lane.priority);
+        if (!conn) break;
+        if (replicas_) replicas_->begin(host);
+        auto op = std::move(lane.pending.front());
+        lane.pending.pop_front();
+        start(lane, std::move(pool), host, std::move(conn), std::move(op));
+    }
+
+    // One pool request per queued op; surplus ones are withdrawn unless the
+    // pool has already granted them.
+    while (lane.requests.size() < lane.pending.size() && !closed_) request(lane);
+    while (lane.requests.size() > lane.pending.size() && lane.requests.back().pool->cancel(lane.requests.back().ticket)) {
+        if (replicas_) replicas_->end(lane.requests.back().host);
+        lane.requests.pop_back();
+    }
+}
+
+// Each read request picks its replica on its own, so a burst of reads is
+// spread out rather than queued on one host.
+void QueryEngine::request(Lane& lane) {
+    uint64_t id = nextRequest_++;
+    int host = lane.readOnly ? replicas_->pick() : -1;
+    auto pool = host < 0 ? pool_ : replicas_->pool(host);
+    auto mailbox = mailbox_;
+    std::weak_ptr<ConnectionPool> weak = pool;
+    auto grant = [mailbox, weak, id](std::shared_ptr<PgConnection> conn, const std::string& error, bool shed) {
+        auto owner = weak.lock();
+        {
+            std::lock_guard<std::mutex> lock(mailbox->mutex);
+            if (!mailbox->closed) {
+                mailbox->grants.push_back({id, std::move(owner), std::move(conn), error, shed});
+                uv_async_send(&mailbox->async);
+                return;
+            }
+        }
+        if (owner) owner->release(std::move(conn));
+    };
+    auto ticket = pool->acquireAsync(std::move(grant), lane.priority);
+    if (replicas_) replicas_->begin(host);
+    lane.requests.push_back({id, ticket, std::move(pool), host});
+}
+
+void QueryEngine::OnGrant(uv_async_t* handle) {
+    auto* mailbox = static_cast<Mailbox*>(handle->data);
+    std::vector<Grant> grants;
+    {
+        std::lock_guard<std::mutex> lock(mailbox->mutex);
+        grants.swap(mailbox->grants);
+    }
+
+    auto engine = mailbox->engine->shared_from_this();
+    Napi::HandleScope scope(engine->env_);
+    Napi::CallbackScope callbackScope(engine->env_, engine->context_);
+    for (auto& grant : grants) engine->granted(std::move(grant));
+    engine->dispatch();
+}
+
+void QueryEngine::granted(Grant grant) {
+    Lane* lane = nullptr;
+    int host = -1;
+    for (auto& candidate : lanes_) {
+        auto it = std::find_if(candidate.requests.begin(), candidate.requests.end(),
+                               [&](const Request& r) { return r.id == grant.request; });
+        if (it == candidate.requests.end()) continue;
+        lane = &candidate;
+        host = it->host;
+        candidate.requests.erase(it);
+        break;
+    }
+    // Withdrawn by close().
+    if (!lane) {
+        if (grant.conn && grant.pool) grant.pool->release(std::move(grant.conn));
+        return;
+    }
+    if (replicas_ && (!grant.conn || closed_ || lane->pending.empty())) replicas_->end(host);
+
+    if (grant.shed) {
+        // Turned away to keep the queue bounded: the newest op in line goes.
+        if (lane->pending.empty()) return;
+        auto op = std::move(lane->pending.back());
+        lane->pending.pop_back();
+        op->errorCode = "POOL_OVERLOADED";
+        abandon(*op, grant.error);
+        return;
+    }
+    if (!grant.conn) {
+        // A replica that can't be reached sits out for a while; the reads
+        // waiting on it go to another one, or to the primary.
+        if (host >= 0) {
+            replicas_->fail(host);
+            return;
+        }
+        // The pool only gives up with nothing open or opening; running
+        // queries would otherwise hand their connections on, but pinned ones
+        // stay with their clients.
+        bool handsOn = std::any_of(active_.begin(), active_.end(), [&](Task* t) {
+            return !t->session && t->lane == lane;
+        });
+        if (!handsOn) failPending(*lane, grant.error);
+        return;
+    }
+    if (closed_ || lane->pending.empty()) {
+        grant.pool->release(std::move(grant.conn));
+        return;
+    }
+
+    auto op = std::move(lane->pending.front());
+    lane->pending.pop_front();
+    start(*lane, std::move(grant.pool), host, std::move(grant.conn), std::move(op));
+}
+
+void QueryEngine::armTimer() {
+    auto timeout = pool_->connectionTimeout();
+    auto oldest = std::chrono::steady_clock::time_point::max();
+    for (const auto& lane : lanes_) {
+        if (!lane.pending.empty()) oldest = std::min(oldest, lane.pending.front()->queuedAt);
+    }
+    if (timeout.count() == 0 || oldest == std::chrono::steady_clock::time_point::max() || closed_) {
+        uv_timer_stop(timer_);
+        return;
+    }
+    auto left = oldest + timeout - std::chrono::steady_clock::now();
+    auto delay = std::chrono::ceil<std::chrono::milliseconds>(left).count();
+    uv_timer_start(timer_, &QueryEngine::OnTimer, delay > 0 ? delay : 0, 0);
+}
+
+void QueryEngine::OnTimer(uv_timer_t* handle) {
+    auto engine = static_cast<QueryEngine*>(handle->data)->shared_from_this();
+    Napi::HandleScope scope(engine->env_);
+    Napi::CallbackScope callbackScope(engine->env_, engine->context_);
+    engine->expire();
+}
+
+// Queued ops are in arrival order, so the expired ones are at the front.
+void QueryEngine::expire() {
+    auto timeout = pool_->connectionTimeout();
+    auto now = std::chrono::steady_clock::now();
+    for (auto& lane : lanes_) {
+        // Ops and their pool requests queue in the same order, so the nth op
+        // to expire was waiting on the nth request; a read charges the
+        // replica it was queued on rather than the primary.
+        auto& pending = lane.pending;
+        size_t expired = 0;
+        while (!pending.empty() && now - pending.front()->queuedAt >= timeout) {
+            auto op = std::move(pending.front());
+            pending.pop_front();
+            auto& waited = expired < lane.requests.size() ? lane.requests[expired].pool : pool_;
+            waited->noteTimeout();
+            ++expired;
+            abandon(*op, "Timed out after " + std::to_string(timeout.count()) + "ms waiting for a connection");
+        }
+    }
+    dispatch();
+}
+
+void QueryEngine::start(Lane& lane, std::shared_ptr<ConnectionPool> pool, int host,
+                        std::shared_ptr<PgConnection> conn, std::unique_ptr<QueryOp> op) {
+    auto* task = new Task();
+    task->engine = shared_from_this();
+    task->pool = std::move(pool);
+    task->host = host;
+    task->lane = &lane;
+    task->conn = std::move(conn);
+    task->poll.data = task;
+
+    if (uv_poll_init_socket(loop_, &task->poll, PQsocket(task->conn->raw)) != 0) {
+        task->pool->discard(std::move(task->conn));
+        if (replicas_) replicas_->end(host);
+        delete task;
+        abandon(*op, "Failed to watch connection socket");
+        return;
+    }
+
+    PQsetnonblocking(task->conn->raw, 1);
+    active_.insert(task);
+    run(task, std::move(op));
+}
+
+void QueryEngine::run(Task* task, std::unique_ptr<QueryOp> op) {
+    if (op->session && op->statements.empty()) {
+        pin(task, std::move(op));
+        return;
+    }
+
+    op->startedAt = std::chrono::steady_clock::now();
+    task->op = std::move(op);
+    task->current = 0;
+    task->syncs = 0;
+    task->inStatement = false;
+    task->pipelined = false;
+    task->broken = false;
+    task->paused = false;
+    task->cancelSent = false;
+    task->cancelAcked = false;
+    task->slots.clear();
+    task->results.assign(task->op->statements.size(), nullptr);
+    task->errors.assign(task->op->statements.size(), std::string());
+
+    if (!send(task)) complete(task, false);
+}
+
+static int SendCommand(PGconn* raw, CommandKind kind, const std::string& name, const Statement& stmt,
+                       bool pipelined, int resultFormat) {
+    const auto& params = stmt.params;
+    auto values = params.pointers();
+    auto lengths = params.lengths();
+    switch (kind) {
+        case CommandKind::Close:
+#ifdef LIBPQ_HAS_CLOSE_PREPARED
+            return PQsendClosePrepared(raw, name.c_str());
+#else
+            return PQsendQueryParams(raw, ("DEALLOCATE " + name).c_str(), 0, nullptr, nullptr, nullptr, nullptr, 0);
+#endif
+        case CommandKind::Prepare:
+            return PQsendPrepare(raw, name.c_str(), stmt.sql.c_str(), params.typeData() ? params.size() : 0, params.typeData());
+        default:
+            if (!name.empty()) {
+                return PQsendQueryPrepared(raw, name.c_str(), params.size(), values.data(), lengths.data(),
+                                           params.formatData(), resultFormat);
+            }
+            // The simple protocol allows several statements in one string, but
+            // only outside pipeline mode and only with text results.
+            if (params.empty() && !pipelined && resultFormat == 0) return PQsendQuery(raw, stmt.sql.c_str());
+            return PQsendQueryParams(raw, stmt.sql.c_str(), params.size(), params.typeData(), values.data(),
+                                     lengths.data(), params.formatData(), resultFormat);
+    }
+}
+
+// Statements this connection has not prepared yet get a Parse (and a Close
+// for whatever the LRU evicts) queued ahead of them. Anything beyond a lone
+// statement goes out in pipeline mode with a single flush.
+bool QueryEngine::send(Task* task) {
+    PGconn* raw = task->conn->raw;
+    auto& op = *task->op;
+    auto& cache = task->conn->statements;
+    auto& stats = pool_->statementStats();
+
+    struct Command {
+        CommandKind kind;
+        size_t statement;
+        std::string name;
+    };
+    std::vector<Command> commands;
+    commands.reserve(op.statements.size());
+
+    for (size_t i = 0; i < op.statements.size(); ++i) {
+        const auto& stmt = op.statements[i];
+        if (stmt.prepare == PrepareMode::None) {
+            commands.push_back({CommandKind::Execute, i, std::string()});
+            continue;
+        }
+        auto key = stmt.cacheKey();
+        if (const auto* name = cache.find(key)) {
+            stats.hits++;
+            commands.push_back({CommandKind::Execute, i, *name});
+            continue;
+        }
+
+        stats.misses++;
+        std::string evicted;
+        std::string name = cache.add(key, stmt.prepare == PrepareMode::Pinned, options_.statementCacheSize, &evicted);
+        if (!evicted.empty()) {
+            stats.evictions++;
+            commands.push_back({CommandKind::Close, i, evicted});
+        }
+        commands.push_back({CommandKind::Prepare, i, name});
+        commands.push_back({CommandKind::Execute, i, name});
+    }
+
+    task->pipelined = op.pipeline || commands.size() > 1;
+    if (task->pipelined && !PQenterPipelineMode(raw)) {
+        task->fail(ConnectionError(raw));
+        return false;
+    }
+
+    for (size_t c = 0; c < commands.size(); ++c) {
+        const auto& cmd = commands[c];
+        task->slots.push_back({cmd.statement, cmd.kind, !cmd.name.empty()});
+        if (!SendCommand(raw, cmd.kind, cmd.name, op.statements[cmd.statement], task->pipelined, op.binary ? 1 : 0)) {
+            task->fail(ConnectionError(raw));
+            return false;
+        }
+        if (!task->pipelined) continue;
+
+        bool last = c + 1 == commands.size();
+        bool statementDone = last || commands[c + 1].statement != cmd.statement;
+        if (last || (op.isolate && statementDone)) {
+#ifdef LIBPQ_HAS_SEND_PIPELINE_SYNC
+            int synced = last ? PQpipelineSync(raw) : PQsendPipelineSync(raw);
+#else
+            int synced = PQpipelineSync(raw);
+#endif
+            if (!synced) {
+                task->fail(ConnectionError(raw));
+                return false;
+            }
+            task->syncs++;
+        }
+    }
+
+    if (op.stream) {
+#ifdef LIBPQ_HAS_CHUNK_MODE
+        int rowMode = PQsetChunkedRowsMode(raw, static_cast<int>(op.stream->batchSize));
+#else
+        int rowMode = PQsetSingleRowMode(raw);
+#endif
+        if (!rowMode) {
+            task->fail(ConnectionError(raw));
+            return false;
+        }
+    }
+    return flush(task);
+}
+
+bool QueryEngine::flush(Task* task) {
+    PGconn* raw = task->conn->raw;
+    int flushed = PQflush(raw);
+    if (flushed < 0) {
+        task->fail(ConnectionError(raw));
+        return false;
+    }
+    task->flushing = flushed == 1;
+    watch(task, UV_READABLE | (task->flushing ? UV_WRITABLE : 0));
+    return true;
+}
+
+void QueryEngine::watch(Task* task, int events) {
+    if (task->events == events) return;
+    task->events = events;
+    if (events == 0) {
+        uv_poll_stop(&task->poll);
+    } else {
+        uv_poll_start(&task->poll, events, &QueryEngine::OnPoll);
+    }
+}
+
+void QueryEngine::OnPoll(uv_poll_t* handle, int status, int events) {
+    auto* task = static_cast<Task*>(handle->data);
+    auto engine = task->engine;
+    Napi::HandleScope scope(engine->env_);
+    Napi::CallbackScope callbackScope(engine->env_, engine->context_);
+    engine->service(task, status, events);
+}
+
+void QueryEngine::service(Task* task, int status, int events) {
+    PGconn* raw = task->conn->raw;
+
+    if (status < 0) {
+        task->fail(uv_strerror(status));
+        complete(task, false);
+        return;
+    }
+    if ((events & UV_READABLE) && !PQconsumeInput(raw)) {
+        task->fail(ConnectionError(raw));
+        complete(task, false);
+        return;
+    }
+    if (task->flushing) {
+        int flushed = PQflush(raw);
+        if (flushed < 0) {
+            task->fail(ConnectionError(raw));
+            complete(task, false);
+            return;
+        }
+        if (flushed == 0) {
+            task->flushing = false;
+            watch(task, task->paused ? 0 : UV_READABLE);
+        }
+    }
+
+    drain(task);
+}
+
+void QueryEngine::drain(Task* task) {
+    PGconn* raw = task->conn->raw;
+
+    while (!PQisBusy(raw)) {
+        // While a COPY runs, its data moves instead of results; once the
+        // copy is over the final result is read as usual.
+        if (task->op->copy && task->op->copy->active) {
+            if (!pumpCopy(task)) return;
+            continue;
+        }
+
+        // A stream stops reading while a batch waits to be claimed; the
+        // socket backs up and the server blocks until next() resumes us.
+        if (task->op->stream && !task->op->stream->ready.empty()) {
+            task->paused = true;
+            watch(task, task->flushing ? UV_WRITABLE : 0);
+            return;
+        }
+
+        PGresult* res = PQgetResult(raw);
+        if (res) {
+            collect(task, res);
+            if (task->broken || PQstatus(raw) != CONNECTION_OK) {
+                complete(task, false);
+                return;
+            }
+            continue;
+        }
+
+        if (!task->pipelined) {
+            complete(task, true);
+            return;
+        }
+        // In a pipeline, NULL ends one statement's results; once every sync
+        // has come back the batch is done.
+        if (task->inStatement) {
+            task->inStatement = false;
+            task->current++;
+            continue;
+        }
+        if (task->syncs == 0) {
+            PQexitPipelineMode(raw);
+            complete(task, true);
+        }
+        return;
+    }
+}
+
+void QueryEngine::collect(Task* task, PGresult* res) {
+    const auto& slot = task->slots[std::min(task->current, task->slots.size() - 1)];
+    auto key = task->op->statements[slot.statement].cacheKey();
+    auto& result = task->results[slot.statement];
+    auto& error = task->errors[slot.statement];
+
+    switch (PQresultStatus(res)) {
+        case PGRES_PIPELINE_SYNC:
+            task->syncs--;
+            break;
+        case PGRES_PIPELINE_ABORTED:
+            task->inStatement = true;
+            if (slot.kind == CommandKind::Prepare) task->conn->statements.forget(key);
+            if (slot.kind != CommandKind::Close && error.empty()) {
+                error = "Skipped: an earlier statement in the pipeline failed";
+            }
+            break;
+        case PGRES_SINGLE_TUPLE:
+#ifdef LIBPQ_HAS_CHUNK_MODE
+        case PGRES_TUPLES_CHUNK:
+#endif
+            if (auto& stream = task->op->stream) {
+                stream->batch.push_back(res);
+                stream->batchRows += PQntuples(res);
+                if (stream->batchRows >= stream->batchSize) emit(*stream);
+                return;
+            }
+            break;
+        case PGRES_TUPLES_OK:
+        case PGRES_COMMAND_OK:
+        case PGRES_EMPTY_QUERY:
+            task->inStatement = true;
+            // A stream's rows have already gone out in batches.
+            if (slot.kind != CommandKind::Execute || task->op->stream) break;
+            if (result) PQclear(result);
+            result = res;
+            return;
+        case PGRES_COPY_IN:
+            if (task->op->copy && !task->op->copy->out) {
+                task->op->copy->active = true;
+                break;
+            }
+            PQputCopyEnd(task->conn->raw, task->op->copy ? "copyTo() needs COPY ... TO STDOUT"
+                                                         : "COPY is not supported by query()");
+            break;
+        case PGRES_COPY_OUT:
+            if (task->op->copy && task->op->copy->out) {
+                task->op->copy->active = true;
+                break;
+            }
+            [[fallthrough]];
+        case PGRES_COPY_BOTH:
+            // There is no way to abort a COPY TO from the client side; drop the connection.
+            if (error.empty()) {
+                error = task->op->copy ? "copyFrom() needs COPY ... FROM STDIN" : "COPY is not supported by query()";
+            }
+            task->broken = true;
+            break;
+        default: {
+            task->inStatement = true;
+            if (slot.kind == CommandKind::Close) break;
+
+            // Forget statements the server does not have, e.g. after DEALLOCATE ALL.
+            const char* state = PQresultErrorField(res, PG_DIAG_SQLSTATE);
+            bool missing = state && std::string(state) == "26000";
+            if (state && std::string(state) == "57014") task->cancelAcked = true;
+            if (slot.kind == CommandKind::Prepare || (slot.prepared && missing)) {
+                task->conn->statements.forget(key);
+            }
+            if (error.empty()) error = ResultError(res);
+            break;
+        }
+    }
+    PQclear(res);
+}
+
+void QueryEngine::complete(Task* task, bool reusable) {
+    // An unconfirmed cancel may still reach the server and would hit
+    // whatever runs next on this connection.
+    if (task->cancelSent && !task->cancelAcked) reusable = false;
+    if (!reusable) {
+        // Statements still outstanding on a dead connection never ran.
+        for (size_t i = task->statementIndex(); i < task->errors.size(); ++i) {
+            if (task->errors[i].empty() && !task->results[i]) task->fail("Connection lost", i);
+        }
+    }
+
+    auto op = std::move(task->op);
+    auto results = std::move(task->results);
+    auto errors = std::move(task->errors);
+    task->results.clear();
+    task->errors.clear();
+    op->finishedAt = std::chrono::steady_clock::now();
+    if (replicas_ && task->host >= 0) {
+        if (reusable) {
+            replicas_->observe(task->host, op->finishedAt - op->startedAt);
+        } else if (PQstatus(task->conn->raw) != CONNECTION_OK) {
+            replicas_->fail(task->host);
+        }
+    }
+    // Outside a pinned session nobody will end a transaction this op left
+    // open (a bare BEGIN, say), so the connection can't serve anyone else.
+    if (reusable && !task->session && PQtransactionStatus(task->conn->raw) != PQTRANS_IDLE) reusable = false;
+
+    // Hand the connection straight to the next queued query, if any. A
+    // pinned one stays with its client instead.
+    if (!reusable || closed_) {
+        if (task->session) dropSession(*task->session, closed_ ? "Connection closed" : "Connection lost");
+        retire(task, false);
+    } else if (task->session) {
+        auto& session = *task->session;
+        if (!session.queue.empty()) {
+            auto next = std::move(session.queue.front());
+            session.queue.pop_front();
+            run(task, std::move(next));
+        } else if (session.released) {
+            unpin(task);
+        } else {
+            watch(task, 0);
+        }
+    } else if (auto next = handOff(task)) {
+        run(task, std::move(next));
+    } else {
+        retire(task, true);
+    }
+    if (!closed_) dispatch();
+
+    completed_.push_back({std::move(op), std::move(results), std::move(errors)});
+    if (completed_.size() == 1) {
+        uv_check_start(settleCheck_, &QueryEngine::OnSettle);
+        uv_idle_start(settleIdle_, [](uv_idle_t*) {});
+    }
+}
+
+void QueryEngine::OnSettle(uv_check_t* handle) {
+    auto engine = static_cast<QueryEngine*>(handle->data)->shared_from_this();
+    Napi::HandleScope scope(engine->env_);
+    Napi::CallbackScope callbackScope(engine->env_, engine->context_);
+    engine->settleCompleted();
+}
+
+// Every op that finished during this loop iteration is settled in one pass,
+// under one callback scope, so their promise reactions run in a single
+// microtask checkpoint rather than one per socket event. Settling can run
+// JS (the slow-query hook) that completes more ops; they join this pass.
+void QueryEngine::settleCompleted() {
+    while (!completed_.empty()) {
+        auto done = std::move(completed_);
+        completed_.clear();
+        for (auto& completion : done) {
+            settle(*completion.op, completion.results, completion.errors);
+            for (auto* res : completion.results) {
+                if (res) PQclear(res);
+            }
+        }
+    }
+    uv_check_stop(settleCheck_);
+    uv_idle_stop(settleIdle_);
+}
+
+// For teardown: nothing is left to observe these promises.
+void QueryEngine::dropCompleted() {
+    for (auto& completion : completed_) {
+        for (auto* res : completion.results) {
+            if (res) PQclear(res);
+        }
+    }
+    completed_.clear();
+    uv_check_stop(settleCheck_);
+    uv_idle_stop(settleIdle_);
+}
+
+// The next queued op of the task's lane, which keeps its connection without
+// a trip through the pool. Batch work gives its connection back instead
+// while interactive work waits, here or in the pool, and a connection past
+// its lifetime goes back so the pool can replace it. A shared pool's
+// connections go back whenever anyone waits there, so its FIFO decides who
+// is next and one busy engine can't keep them from the others.
+std::unique_ptr<QueryOp> QueryEngine::handOff(Task* task) {
+    auto& pending = task->lane->pending;
+    if (pending.empty()) return nullptr;
+    if (std::chrono::steady_clock::now() >= task->conn->retireAt) return nullptr;
+    if (task->pool->shared() &&
+        task->pool->waiting(Priority::Interactive) + task->pool->waiting(Priority::Batch) > 0) {
+        return nullptr;
+    }
+    if (task->lane->priority == Priority::Batch &&
+        (!lane(task->lane->readOnly, Priority::Interactive).pending.empty() || task->pool->waiting(Priority::Interactive) > 0)) {
+        return nullptr;
+    }
+    auto next = std::move(pending.front());
+    pending.pop_front();
+    return next;
+}
+
+void QueryEngine::retire(Task* task, bool healthy) {
+    uv_poll_stop(&task->poll);
+    active_.erase(task);
+
+    if (healthy) {
+        auto conn = std::move(task->conn);
+        PQsetnonblocking(conn->raw, 0);
+        task->pool->release(std::move(conn));
+    } else {
+        // The socket stays open until the handle has finished closing.
+        task->pool->discard(task->conn);
+    }
+    if (replicas_) replicas_->end(task->host);
+
+    uv_close(reinterpret_cast<uv_handle_t*>(&task->poll), [](uv_handle_t* handle) {
+        delete static_cast<Task*>(handle->data);
+    });
+}
+
+// Results with at least this many cells are decoded on a worker thread; below
+// it the thread hop costs more than converting inline.
+static constexpr int64_t OFFLOAD_DECODE_CELLS = 16384;
+
+static Napi::Object StatementResult(Napi::Env env, const PGresult* result) {
+    auto entry = Napi::Object::New(env);
+    entry.Set("rows", ConvertResult(env, result));
+    entry.Set("rowCount", Napi::Number::New(env, result ? std::strtod(PQcmdTuples(const_cast<PGresult*>(result)), nullptr) : 0));
+    return entry;
+}
+
+// Results handed off to a worker are nulled out of `results`.
+void QueryEngine::settle(QueryOp& op, std::vector<PGresult*>& results, const std::vector<std::string>& errors) {
+    if (!op.batch.empty()) {
+        // An abandoned batch carries one error for everyone. Members get
+        // their statements back so their metrics name the right SQL.
+        bool shared = errors.size() != op.batch.size();
+        bool moved = op.statements.size() == op.batch.size();
+        for (size_t i = 0; i < op.batch.size(); ++i) {
+            auto& member = *op.batch[i];
+            if (moved) member.statements.front() = std::move(op.statements[i]);
+            member.startedAt = op.startedAt;
+            member.finishedAt = op.finishedAt;
+            member.errorCode = op.errorCode;
+            std::vector<PGresult*> one{i < results.size() ? results[i] : nullptr};
+            std::string error = shared ? (errors.empty() ? std::string() : errors[0]) : errors[i];
+            settle(member, one, {error});
+            if (i < results.size()) results[i] = one[0];
+        }
+        return;
+    }
+
+    // A query aborted while running was rejected then; its results are dropped.
+    bool rejected = false;
+    if (op.cancel) {
+        rejected = op.cancel->rejected;
+        disarm(op);
+    }
+
+    uint64_t rows = 0;
+    uint64_t bytes = 0;
+    for (const auto* res : results) {
+        if (!res) continue;
+        rows += PQntuples(res);
+        bytes += PQresultMemorySize(res);
+    }
+    std::string error = rejected ? op.cancel->reason : std::string();
+    for (const auto& e : errors) {
+        if (!error.empty()) break;
+        error = e;
+    }
+
+    auto sample = sampleOf(op, rows, bytes, std::move(error));
+    auto decodeStart = std::chrono::steady_clock::now();
+    if (!rejected && resolve(op, results, errors, sample)) return;
+    record(sample, std::chrono::steady_clock::now() - decodeStart);
+}
+
+bool QueryEngine::resolve(QueryOp& op, std::vector<PGresult*>& results, const std::vector<std::string>& errors,
+                          Sample& sample) {
+    if (op.stream) {
+        endStream(op, errors.empty() ? std::string() : errors[0]);
+        return false;
+    }
+    if (op.copy) {
+        finishCopy(op, results, errors.empty() ? std::string() : errors[0]);
+        return false;
+    }
+    if (!op.pipeline) {
+        if (!errors.empty() && !errors[0].empty()) {
+            auto error = Napi::Error::New(env_, errors[0]);
+            if (!op.errorCode.empty()) error.Set("code", Napi::String::New(env_, op.errorCode));
+            op.deferred.Reject(error.Value());
+        } else if (op.cache && !results.empty() && results[0] && PQresultStatus(results[0]) == PGRES_TUPLES_OK) {
+            resolveCached(op, results[0]);
+        } else if (op.rowMode == RowMode::Columnar) {
+            PGresult* result = results.empty() ? nullptr : std::exchange(results[0], nullptr);
+            ResolveColumnar(env_, op.deferred, result, recordWhenDecoded(sample));
+            return true;
+        } else if (op.buffers) {
+            // The rows point into the result, so it is not decoded elsewhere.
+            PGresult* result = results.empty() ? nullptr : std::exchange(results[0], nullptr);
+            op.deferred.Resolve(ConvertResult(env_, result, *op.buffers));
+        } else if (!results.empty() && results[0] &&
+                   int64_t(PQntuples(results[0])) * PQnfields(results[0]) >= OFFLOAD_DECODE_CELLS) {
+            ResolveRows(env_, op.deferred, std::exchange(results[0], nullptr), recordWhenDecoded(sample));
+            return true;
+        } else {
+            op.deferred.Resolve(ConvertResult(env_, results.empty() ? nullptr : results[0]));
+        }
+        return false;
+    }
+
+    if (!op.isolate) {
+        for (size_t i = 0; i < errors.size(); ++i) {
+            if (errors[i].empty()) continue;
+            auto error = Napi::Error::New(env_, errors[i]);
+            error.Set("statementIndex", Napi::Number::New(env_, static_cast<double>(i)));
+            if (!op.errorCode.empty()) error.Set("code", Napi::String::New(env_, op.errorCode));
+            op.deferred.Reject(error.Value());
+            return false;
+        }
+    }
+
+    auto entries = Napi::Array::New(env_, op.statements.size());
+    for (size_t i = 0; i < op.statements.size(); ++i) {
+        if (i < errors.size() && !errors[i].empty()) {
+            auto entry = Napi::Object::New(env_);
+            entry.Set("error", Napi::Error::New(env_, errors[i]).Value());
+            entries[i] = entry;
+        } else {
+            entries[i] = StatementResult(env_, i < results.size() ? results[i] : nullptr);
+        }
+    }
+    op.deferred.Resolve(entries);
+    return false;
+}
+
+QueryEngine::Sample QueryEngine::sampleOf(const QueryOp& op, uint64_t rows, uint64_t bytes, std::string error) const {
+    Sample sample;
+    if (!slowQueryHook_.IsEmpty()) {
+        for (const auto& stmt : op.statements) sample.sql.push_back(stmt.sql);
+    }
+    sample.statements = op.statements.size();
+    sample.submittedAt = op.submittedAt;
+    sample.startedAt = op.startedAt;
+    sample.finishedAt = op.finishedAt;
+    sample.rows = rows;
+    sample.bytes = bytes;
+    sample.error = std::move(error);
+    return sample;
+}
+
+// For results decoded on a worker: decode and total then end once the JS
+// values exist, not when the worker was queued.
+Decoded QueryEngine::recordWhenDecoded(Sample& sample) {
+    std::weak_ptr<QueryEngine> weak = shared_from_this();
+    return [weak, sample = std::move(sample)](std::chrono::steady_clock::duration decode) {
+        if (auto engine = weak.lock()) engine->record(sample, decode);
+    };
+}
+
+void QueryEngine::record(const Sample& sample, std::chrono::steady_clock::duration decode) {
+    // Pinning a client and empty submissions are not queries.
+    if (sample.statements == 0) return;
+    auto now = std::chrono::steady_clock::now();
+    metrics_.queries++;
+    if (!sample.error.empty()) metrics_.errors++;
+    if (sample.cached) metrics_.cached++;
+    metrics_.rows += sample.rows;
+    metrics_.bytes += sample.bytes;
+
+    bool sent = sample.startedAt != std::chrono::steady_clock::time_point();
+    if (sent) {
+        metrics_.acquire.record(sample.startedAt - sample.submittedAt);
+        metrics_.execute.record(sample.finishedAt - sample.startedAt);
+    }
+    if (sent || sample.cached) metrics_.decode.record(decode);
+    metrics_.total.record(now - sample.submittedAt);
+
+    if (slowQueryHook_.IsEmpty() || now - sample.submittedAt < slowQuery_) return;
+    metrics_.slowQueries++;
+    reportSlow(sample);
+}
+
+static double Millis(std::chrono::steady_clock::duration elapsed) {
+    return std::chrono::duration<double, std::milli>(elapsed).count();
+}
+
+void QueryEngine::onSlowQuery(std::chrono::milliseconds threshold, Napi::Function callback) {
+    slowQuery_ = threshold;
+    slowQueryHook_ = Napi::Persistent(callback);
+}
+
+// Only the fingerprint goes out, so literals that may hold personal data
+// stay out of logs.
+void QueryEngine::reportSlow(const Sample& sample) {
+    std::string fingerprint;
+    for (const auto& sql : sample.sql) {
+        if (!fingerprint.empty()) fingerprint += "; ";
+        fingerprint += Fingerprint(sql);
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    bool sent = sample.startedAt != std::chrono::steady_clock::time_point();
+    auto info = Napi::Object::New(env_);
+    info.Set("fingerprint", Napi::String::New(env_, fingerprint));
+    info.Set("statements", Napi::Number::New(env_, static_cast<double>(sample.statements)));
+    info.Set("durationMs", Napi::Number::New(env_, Millis(now - sample.submittedAt)));
+    info.Set("acquireMs", Napi::Number::New(env_, sent ? Millis(sample.startedAt - sample.submittedAt) : 0));
+    info.Set("executeMs", Napi::Number::New(env_, sent ? Millis(sample.finishedAt - sample.startedAt) : 0));
+    info.Set("rows", Napi::Number::New(env_, static_cast<double>(sample.rows)));
+    if (sample.cached) info.Set("cached", Napi::Boolean::New(env_, true));
+    if (!sample.error.empty()) info.Set("error", Napi::String::New(env_, sample.error));
+
+    slowQueryHook_.Call({info});
+    // A throwing hook must not stop the rest of a batch from settling.
+    if (env_.IsExceptionPending()) {
+        auto thrown = env_.GetAndClearPendingException();
+        napi_fatal_exception(env_, thrown.Value());
+    }
+}
+
+// Cached rows are kept decoded, so hits and the first answer are built from
+// the same buffer.
+void QueryEngine::resolveCached(QueryOp& op, const PGresult* result) {
+    std::shared_ptr<const ResultBuffer> rows;
+    try {
+        rows = std::make_shared<ResultBuffer>(result);
+    } catch (const std::length_error&) {
+        op.deferred.Resolve(ConvertResult(env_, result));
+        return;
+    }
+    cache_->put(*op.cache, rows);
+    op.deferred.Resolve(ConvertResult(env_, *rows));
+}
+
+void QueryEngine::invalidate(const std::string& payload) {
+    if (!cache_) return;
+    if (payload.empty() || payload == "*") {
+        cache_->clear();
+        return;
+    }
+    size_t start = 0;
+    while (start <= payload.size()) {
+        size_t end = payload.find(',', start);
+        if (end == std::string::npos) end = payload.size();
+        if (end > start) cache_->invalidate(payload.substr(start, end - start));
+        start = end + 1;
+    }
+}
+
+// What a query aborted through its signal rejects with: the signal's reason,
+// as with fetch().
+static Napi::Value AbortReason(Napi::Env env, Napi::Object signal) {
+    auto reason = signal.Get("reason");
+    if (!reason.IsUndefined()) return reason;
+    auto error = Napi::Error::New(env, "Query cancelled");
+    error.Set("name", Napi::String::New(env, "AbortError"));
+    return error.Value();
+}
+
+// The timeout counts from submission, so time queued for a connection is
+// included.
+bool QueryEngine::arm(QueryOp& op) {
+    auto& cancel = *op.cancel;
+    if (!cancel.signal.IsEmpty()) {
+        auto signal = cancel.signal.Value();
+        if (signal.Get("aborted").ToBoolean().Value()) {
+            cancel.rejected = true;
+            cancel.reason = "Query cancelled";
+            op.deferred.Reject(AbortReason(env_, signal));
+            return false;
+        }
+
+        std::weak_ptr<QueryEngine> engine = shared_from_this();
+        std::weak_ptr<Cancel> watched = op.cancel;
+        auto listener = Napi::Function::New(env_, [engine, watched](const Napi::CallbackInfo& info) {
+            auto live = engine.lock();
+            auto target = watched.lock();
+            if (!live || !target || target->done) return;
+            live->abort(target, AbortReason(info.Env(), target->signal.Value()), "Query cancelled");
+        }, "abort");
+        signal.Get("addEventListener").As<Napi::Function>().Call(signal, {Napi::String::New(env_, "abort"), listener});
+        cancel.listener = Napi::Persistent(listener);
+    }
+    if (cancel.timeout.count() > 0) schedule(op.cancel, op.submittedAt + cancel.timeout);
+    return true;
+}
+
+// Long-lived signals would otherwise collect a listener per query.
+void QueryEngine::disarm(QueryOp& op) {
+    auto& cancel = *op.cancel;
+    cancel.done = true;
+    schedule(op.cancel, std::chrono::steady_clock::time_point::max());
+    if (!cancel.listener.IsEmpty()) {
+        auto signal = cancel.signal.Value();
+        signal.Get("removeEventListener").As<Napi::Function>().Call(signal, {Napi::String::New(env_, "abort"), cancel.listener.Value()});
+        cancel.listener.Reset();
+    }
+    cancel.signal.Reset();
+}
+
+void QueryEngine::abort(const std::shared_ptr<Cancel>& cancel, Napi::Value reason, const std::string& message) {
+    if (cancel->done || cancel->rejected) return;
+
+    // Still queued: it never gets a connection.
+    auto take = [&](std::deque<std::unique_ptr<QueryOp>>& queue) -> std::unique_ptr<QueryOp> {
+        auto it = std::find_if(queue.begin(), queue.end(), [&](const auto& op) { return op->cancel == cancel; });
+        if (it == queue.end()) return nullptr;
+        auto op = std::move(*it);
+        queue.erase(it);
+        return op;
+    };
+    std::unique_ptr<QueryOp> op;
+    for (auto it = lanes_.begin(); !op && it != lanes_.end(); ++it) op = take(it->pending);
+    for (auto it = active_.begin(); !op && it != active_.end(); ++it) {
+        if ((*it)->session) op = take((*it)->session->queue);
+    }
+    if (op) {
+        cancel->rejected = true;
+        cancel->reason = message;
+        op->deferred.Reject(reason);
+        abandon(*op, message);
+        dispatch();
+        return;
+    }
+
+    auto running = std::find_if(active_.begin(), active_.end(), [&](Task* t) { return t->op && t->op->cancel == cancel; });
+    if (running == active_.end()) return;
+    cancel->rejected = true;
+    cancel->reason = message;
+    (*running)->op->deferred.Reject(reason);
+    requestCancel(*running);
+}
+
+// How long the server gets to confirm a cancel before the connection is
+// closed instead.
+static constexpr std::chrono::seconds CANCEL_GRACE{5};
+
+// PQcancel opens its own connection and blocks until the server has the
+// request, so it runs on a thread of its own. The PGcancel it uses is
+// independent of the pooled connection.
+void QueryEngine::requestCancel(Task* task) {
+    auto cancel = task->op->cancel;
+    cancel->requested = true;
+    task->cancelSent = true;
+
+    PGcancel* request = PQgetCancel(task->conn->raw);
+    if (!request) {
+        task->fail(cancel->reason);
+        complete(task, false);
+        return;
+    }
+    std::thread([request]() {
+        char error[256];
+        PQcancel(request, error, sizeof(error));
+        PQfreeCancel(request);
+    }).detach();
+    schedule(cancel, std::chrono::steady_clock::now() + CANCEL_GRACE);
+}
+
+// Each cancel has at most one deadline; max() clears it.
+void QueryEngine::schedule(const std::shared_ptr<Cancel>& cancel, std::chrono::steady_clock::time_point at) {
+    auto none = std::chrono::steady_clock::time_point::max();
+    if (cancel->deadline == none && at == none) return;
+    if (cancel->deadline != none) {
+        auto range = deadlines_.equal_range(cancel->deadline);
+        for (auto it = range.first; it != range.second; ++it) {
+            if (it->second.lock() != cancel) continue;
+            deadlines_.erase(it);
+            break;
+        }
+    }
+    cancel->deadline = at;
+    if (at != none) deadlines_.emplace(at, cancel);
+    armDeadlines();
+}
+
+void QueryEngine::armDeadlines() {
+    if (deadlines_.empty() || closed_) {
+        uv_timer_stop(deadlineTimer_);
+        return;
+    }
+    auto left = deadlines_.begin()->first - std::chrono::steady_clock::now();
+    auto delay = std::chrono::ceil<std::chrono::milliseconds>(left).count();
+    uv_timer_start(deadlineTimer_, &QueryEngine::OnDeadline, delay > 0 ? delay : 0, 0);
+}
+
+void QueryEngine::OnDeadline(uv_timer_t* handle) {
+    auto engine = static_cast<QueryEngine*>(handle->data)->shared_from_this();
+    Napi::HandleScope scope(engine->env_);
+    Napi::CallbackScope callbackScope(engine->env_, engine->context_);
+    engine->expireDeadlines();
+}
+
+void QueryEngine::expireDeadlines() {
+    auto now = std::chrono::steady_clock::now();
+    while (!deadlines_.empty() && deadlines_.begin()->first <= now) {
+        auto cancel = deadlines_.begin()->second.lock();
+        deadlines_.erase(deadlines_.begin());
+        if (!cancel || cancel->done) continue;
+        cancel->deadline = std::chrono::steady_clock::time_point::max();
+
+        if (!cancel->requested) {
+            auto message = "Query timed out after " + std::to_string(cancel->timeout.count()) + "ms";
+            abort(cancel, Napi::Error::New(env_, message).Value(), message);
+            continue;
+        }
+        // The server never confirmed the cancel; give up on the connection.
+        for (auto* task : active_) {
+            if (!task->op || task->op->cancel != cancel) continue;
+            task->fail(cancel->reason);
+            complete(task, false);
+            break;
+        }
+    }
+    armDeadlines();
+}
+
+void QueryEngine::abandon(QueryOp& op, const std::string& error) {
+    std::vector<PGresult*> none;
+    settle(op, none, {error});
+}
+
+void QueryEngine::failPending(Lane& lane, const std::string& error) {
+    auto pending = std::move(lane.pending);
+    lane.pending.clear();
+    for (auto& op : pending) abandon(*op, error);
+}
+
+// The socket is left unwatched while the client holds it between queries.
+void QueryEngine::pin(Task* task, std::unique_ptr<QueryOp> op) {
+    task->session = std::move(op->session);
+    watch(task, 0);
+    op->deferred.Resolve(env_.Undefined());
+}
+
+// Rolling back on the client's behalf could hide a bug, so a connection
+// released mid-transaction is closed, which aborts the transaction.
+void QueryEngine::unpin(Task* task) {
+    auto session = std::move(task->session);
+    bool healthy = !session->discard && PQtransactionStatus(task->conn->raw) == PQTRANS_IDLE;
+    auto& pending = lane(false, Priority::Interactive).pending;
+    if (healthy && !pending.empty()) {
+        auto next = std::move(pending.front());
+        pending.pop_front();
+        run(task, std::move(next));
+    } else {
+        retire(task, healthy);
+    }
+}
+
+void QueryEngine::dropSession(Session& session, const std::string& error) {
+    session.error = error;
+    auto queue = std::move(session.queue);
+    session.queue.clear();
+    for (auto& op : queue) abandon(*op, error);
+}
+
+static void ClearResults(std::vector<PGresult*>& results) {
+    for (auto* res : results) PQclear(res);
+    results.clear();
+}
+
+void QueryEngine::emit(RowStream& stream) {
+    auto batch = std::move(stream.batch);
+    stream.batch.clear();
+    stream.batchRows = 0;
+
+    if (!stream.waiting) {
+        stream.ready.push_back(std::move(batch));
+        return;
+    }
+    auto waiting = std::move(stream.waiting);
+    waiting->Resolve(ConvertResults(env_, batch));
+    ClearResults(batch);
+}
+
+// The stream's own promise always resolves; its rows and any error reach JS
+// through next().
+void QueryEngine::endStream(QueryOp& op, const std::string& error) {
+    auto& stream = *op.stream;
+    if (stream.cancelled) {
+        stream.clear();
+    } else if (!error.empty()) {
+        ClearResults(stream.batch);
+        stream.batchRows = 0;
+        stream.error = error;
+    } else if (stream.batchRows > 0) {
+        emit(stream);
+    }
+    stream.done = true;
+
+    if (auto waiting = std::move(stream.waiting)) {
+        if (stream.error.empty()) {
+            waiting->Resolve(env_.Null());
+        } else {
+            waiting->Reject(Napi::Error::New(env_, stream.error).Value());
+        }
+    }
+    op.deferred.Resolve(env_.Undefined());
+}
+
+QueryEngine::Task* QueryEngine::findTask(const void* channel) const {
+    for (auto* task : active_) {
+        if (task->session.get() == channel) return task;
+        if (task->op && (task->op->stream.get() == channel || task->op->copy.get() == channel)) return task;
+    }
+    return nullptr;
+}
+
+// Reads again from a task that stopped while its data waited for JS.
+void QueryEngine::resume(Task* task) {
+    if (!task || !task->paused) return;
+    task->paused = false;
+    watch(task, UV_READABLE | (task->flushing ? UV_WRITABLE : 0));
+    drain(task);
+}
+
+void QueryEngine::cancelChannel(const void* channel) {
+    for (auto& lane : lanes_) {
+        auto& pending = lane.pending;
+        for (auto it = pending.begin(); it != pending.end(); ++it) {
+            if ((*it)->stream.get() != channel && (*it)->copy.get() != channel) continue;
+            auto op = std::move(*it);
+            pending.erase(it);
+            abandon(*op, "Cancelled");
+            return;
+        }
+    }
+    if (auto* task = findTask(channel)) {
+        task->fail("Cancelled");
+        complete(task, false);
+    }
+}
+
+Napi::Promise QueryEngine::next(const std::shared_ptr<RowStream>& stream) {
+    auto deferred = Napi::Promise::Deferred::New(env_);
+    auto promise = deferred.Promise();
+
+    if (stream->waiting) {
+        deferred.Reject(Napi::Error::New(env_, "next() called before the previous batch arrived").Value());
+        return promise;
+    }
+    if (!stream->ready.empty()) {
+        auto batch = std::move(stream->ready.front());
+        stream->ready.pop_front();
+        deferred.Resolve(ConvertResults(env_, batch));
+        ClearResults(batch);
+    } else if (stream->done) {
+        if (stream->error.empty()) {
+            deferred.Resolve(env_.Null());
+        } else {
+            deferred.Reject(Napi::Error::New(env_, stream->error).Value());
+        }
+        return promise;
+    } else {
+        stream->waiting = std::make_unique<Napi::Promise::Deferred>(deferred);
+    }
+
+    resume(findTask(stream.get()));
+    return promise;
+}
+
+void QueryEngine::cancel(const std::shared_ptr<RowStream>& stream) {
+    if (stream->done) {
+        stream->clear();
+        return;
+    }
+    stream->cancelled = true;
+    cancelChannel(stream.get());
+}
+
+// Server data is handed to JS in chunks of about this size.
+static constexpr size_t COPY_CHUNK_BYTES = 64 * 1024;
+
+bool QueryEngine::pumpCopy(Task* task) {
+    return task->op->copy->out ? pumpCopyOut(task) : pumpCopyIn(task);
+}
+
+// Returns true once the copy is over and its final result can be read.
+bool QueryEngine::pumpCopyOut(Task* task) {
+    PGconn* raw = task->conn->raw;
+    auto& copy = *task->op->copy;
+
+    for (;;) {
+        if (copy.data.size() >= COPY_CHUNK_BYTES) {
+            if (!copy.waiting) {
+                task->paused = true;
+                watch(task, task->flushing ? UV_WRITABLE : 0);
+                return false;
+            }
+            deliverCopy(copy);
+        }
+
+        char* buf = nullptr;
+        int len = PQgetCopyData(raw, &buf, 1);
+        if (len > 0) {
+            copy.data.append(buf, len);
+            PQfreemem(buf);
+            continue;
+        }
+        if (len == 0) {
+            if (copy.waiting && !copy.data.empty()) deliverCopy(copy);
+            return false;
+        }
+        // -1 is the end of the data, -2 a failure; the final result says which.
+        copy.active = false;
+        return true;
+    }
+}
+
+bool QueryEngine::pumpCopyIn(Task* task) {
+    PGconn* raw = task->conn->raw;
+    auto& copy = *task->op->copy;
+
+    if (copy.hasChunk) {
+        int sent = PQputCopyData(raw, copy.data.data(), static_cast<int>(copy.data.size()));
+        if (sent == 0) {
+            // libpq's buffer is full; try again once the socket drains.
+            task->flushing = true;
+            watch(task, UV_READABLE | UV_WRITABLE);
+            return false;
+        }
+        if (sent < 0) {
+            task->fail(ConnectionError(raw));
+            complete(task, false);
+            return false;
+        }
+        copy.data.clear();
+        copy.hasChunk = false;
+        if (auto waiting = std::move(copy.waiting)) waiting->Resolve(env_.Undefined());
+    }
+
+    if (copy.ending) {
+        int ended = PQputCopyEnd(raw, copy.abortReason.empty() ? nullptr : copy.abortReason.c_str());
+        if (ended == 0) {
+            task->flushing = true;
+            watch(task, UV_READABLE | UV_WRITABLE);
+            return false;
+        }
+        if (ended < 0) {
+            task->fail(ConnectionError(raw));
+            complete(task, false);
+            return false;
+        }
+        copy.active = false;
+    }
+
+    if (!flush(task)) {
+        complete(task, false);
+        return false;
+    }
+    return !copy.active;
+}
+
+void QueryEngine::deliverCopy(CopyStream& copy) {
+    auto waiting = std::move(copy.waiting);
+    waiting->Resolve(Napi::Buffer<char>::Copy(env_, copy.data.data(), copy.data.size()));
+    copy.data.clear();
+}
+
+void QueryEngine::finishCopy(QueryOp& op, const std::vector<PGresult*>& results, const std::string& error) {
+    auto& copy = *op.copy;
+    copy.active = false;
+    copy.done = true;
+    copy.error = copy.cancelled ? "Cancelled" : error;
+    if (!copy.out || !copy.error.empty()) copy.data.clear();
+
+    if (auto waiting = std::move(copy.waiting)) {
+        if (!copy.error.empty()) {
+            waiting->Reject(Napi::Error::New(env_, copy.error).Value());
+        } else if (!copy.data.empty()) {
+            copy.waiting = std::move(waiting);
+            deliverCopy(copy);
+        } else {
+            waiting->Resolve(copy.out ? env_.Null() : env_.Undefined());
+        }
+    }
+
+    if (!copy.error.empty()) {
+        op.deferred.Reject(Napi::Error::New(env_, copy.error).Value());
+        return;
+    }
+    PGresult* result = results.empty() ? nullptr : results[0];
+    auto summary = Napi::Object::New(env_);
+    summary.Set("rowCount", Napi::Number::New(env_, result ? std::strtod(PQcmdTuples(result), nullptr) : 0));
+    op.deferred.Resolve(summary);
+}
+
+Napi::Promise QueryEngine::readCopy(const std::shared_ptr<CopyStream>& copy) {
+    auto deferred = Napi::Promise::Deferred::New(env_);
+    auto promise = deferred.Promise();
+
+    if (copy->waiting) {
+        deferred.Reject(Napi::Error::New(env_, "read before the previous chunk arrived").Value());
+        return promise;
+    }
+    if (copy->done && copy->data.empty()) {
+        if (copy->error.empty()) {
+            deferred.Resolve(env_.Null());
+        } else {
+            deferred.Reject(Napi::Error::New(env_, copy->error).Value());
+        }
+        return promise;
+    }
+
+    copy->waiting = std::make_unique<Napi::Promise::Deferred>(deferred);
+    if (!copy->data.empty()) deliverCopy(*copy);
+    resume(findTask(copy.get()));
+    return promise;
+}
+
+Napi::Promise QueryEngine::writeCopy(const std::shared_ptr<CopyStream>& copy, std::string data) {
+    auto deferred = Napi::Promise::Deferred::New(env_);
+    auto promise = deferred.Promise();
+
+    if (copy->done) {
+        deferred.Reject(Napi::Error::New(env_, copy->error.empty() ? "COPY has finished" : copy->error).Value());
+        return promise;
+    }
+    if (copy->waiting || copy->ending) {
+        deferred.Reject(Napi::Error::New(env_, "write after end, or before the previous write resolved").Value());
+        return promise;
+    }
+    copy->data = std::move(data);
+    copy->hasChunk = true;
+    copy->waiting = std::make_unique<Napi::Promise::Deferred>(deferred);
+
+    auto* task = findTask(copy.get());
+    if (task && copy->active) drain(task);
+    return promise;
+}
+
+void QueryEngine::endCopy(const std::shared_ptr<CopyStream>& copy, std::string reason) {
+    if (copy->done || copy->ending) return;
+    copy->ending = true;
+    copy->abortReason = std::move(reason);
+
+    auto* task = findTask(copy.get());
+    if (task && copy->active) drain(task);
+}
+
+void QueryEngine::cancel(const std::shared_ptr<CopyStream>& copy) {
+    if (copy->done) return;
+    copy->cancelled = true;
+    cancelChannel(copy.get());
+}
+
+// Ops are dropped unsettled; nothing is left to observe their promises.
+void QueryEngine::teardown() {
+    closed_ = true;
+    dropCompleted();
+    batch_.clear();
+    uv_timer_stop(batchTimer_);
+    for (auto& lane : lanes_) {
+        lane.pending.clear();
+        for (const auto& req : lane.requests) req.pool->cancel(req.ticket);
+        lane.requests.clear();
+    }
+    uv_timer_stop(timer_);
+    uv_timer_stop(deadlineTimer_);
+    deadlines_.clear();
+
+    auto active = active_;
+    for (auto* task : active) {
+        task->op.reset();
+        for (auto* res : task->results) {
+            if (res) PQclear(res);
+        }
+        task->results.clear();
+        retire(task, false);
+    }
+}
+
+void QueryEngine::close() {
+    if (closed_) return;
+    closed_ = true;
+
+    // Finished before the close, so they keep their results.
+    settleCompleted();
+    auto batch = std::move(batch_);
+    batch_.clear();
+    uv_timer_stop(batchTimer_);
+    for (auto& op : batch) abandon(*op, "Connection closed");
+    for (auto& lane : lanes_) {
+        failPending(lane, "Connection closed");
+        for (const auto& req : lane.requests) req.pool->cancel(req.ticket);
+        lane.requests.clear();
+    }
+    uv_unref(reinterpret_cast<uv_handle_t*>(&mailbox_->async));
+    uv_timer_stop(timer_);
+    uv_timer_stop(deadlineTimer_);
+
+    auto active = active_;
+    for (auto* task : active) {
+        auto op = std::move(task->op);
+        for (auto* res : task->results) {
+            if (res) PQclear(res);
+        }
+        task->results.clear();
+        if (task->session) dropSession(*task->session, "Connection closed");
+        retire(task, false);
+        if (op) abandon(*op, "Connection closed");
+    }
+}
@@ -0,0 +1,419 @@
+#pragma once
+#include <napi.h>
+#include <uv.h>
+#include "connection_pool.h"
+#include "convert.h"
+#include "metrics.h"
+#include "params.h"
+#include "replica_set.h"
+#include "result_cache.h"
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Auto statements are prepared once their SQL has been seen repeatedly and
+// live in each connection's LRU; Pinned ones come from Connection::prepare.
+enum class PrepareMode { None, Auto, Pinned };
+
+struct Statement {
+    std::string sql;
+    QueryParams params;
+    PrepareMode prepare = PrepareMode::None;
+
+    std::string cacheKey() const { return sql + params.signature(); }
+};
+
+enum class CommandKind { Execute, Prepare, Close };
+
+// How a single query's rows are handed back: one object per row, or one
+// array per column (see ResolveColumnar).
+enum class RowMode { Objects, Columnar };
+
+// Rows of a streamed query. The engine collects them in libpq single-row (or
+// chunked) mode and parks each full batch in `ready`; reading from the socket
+// pauses while a batch sits unclaimed, so memory stays at about two batches
+// however large the result is.
+struct RowStream {
+    explicit RowStream(size_t size) : batchSize(size) {}
+    ~RowStream() { clear(); }
+
+    void clear() {
+        for (auto* res : batch) PQclear(res);
+        batch.clear();
+        batchRows = 0;
+        for (auto& pending : ready) {
+            for (auto* res : pending) PQclear(res);
+        }
+        ready.clear();
+    }
+
+    size_t batchSize;
+    std::vector<PGresult*> batch;
+    size_t batchRows = 0;
+    std::deque<std::vector<PGresult*>> ready;
+    std::unique_ptr<Napi::Promise::Deferred> waiting;
+    std::string error;
+    bool done = false;
+    bool cancelled = false;
+};
+
+// Data of a COPY on a pooled connection. For COPY TO STDOUT (`out`), data
+// read from the server collects in `data` and reading pauses once a chunk's
+// worth waits unclaimed. For COPY FROM STDIN, JS writes one chunk at a time
+// and each write resolves once libpq has queued it.
+struct CopyStream {
+    explicit CopyStream(bool toClient) : out(toClient) {}
+
+    bool out;
+    bool active = false;
+    std::string data;
+    bool hasChunk = false;
+    bool ending = false;
+    std::string abortReason;
+    std::unique_ptr<Napi::Promise::Deferred> waiting;
+    std::string error;
+    bool done = false;
+    bool cancelled = false;
+};
+
+struct QueryOp;
+
+// Lets a query be cancelled through an AbortSignal or by its own timeout. A
+// queued query is just dropped. A running one is rejected at once and the
+// server is asked to cancel it; its connection is only reused once the
+// server confirms, so a late cancel can never hit the next query.
+struct Cancel {
+    std::chrono::milliseconds timeout{0};
+    Napi::ObjectReference signal;
+    Napi::FunctionReference listener;
+    // When the timeout, or the grace period after a cancel request, runs out.
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+    bool requested = false;
+    bool rejected = false;
+    bool done = false;
+    // Why the query was rejected, for metrics.
+    std::string reason;
+};
+
+// A pooled connection pinned to one client from connect() until release(),
+// so a transaction's statements all run on the same backend. The client's
+// queries run one at a time, in order, without going back to the pool.
+struct Session {
+    std::deque<std::unique_ptr<QueryOp>> queue;
+    bool released = false;
+    bool discard = false;
+    // Set once the pinned connection is gone; later queries fail with it.
+    std::string error;
+};
+
+struct EngineOptions {
+    size_t statementCacheSize = 0;
+    // Coalesce single queries submitted within `batchWindowMicros` of each
+    // other into one pipeline.
+    bool autoBatch = false;
+    uint32_t batchWindowMicros = 0;
+    // Result cache size; 0 leaves it off.
+    size_t cacheMaxBytes = 0;
+    std::chrono::milliseconds cacheTtl{60000};
+};
+
+// A single query, or a batch sent in libpq pipeline mode. In a pipeline,
+// `isolate` syncs after every statement so each runs in its own implicit
+// transaction; otherwise the whole batch shares one and the first error
+// aborts it.
+struct QueryOp {
+    std::vector<Statement> statements;
+    bool pipeline = false;
+    bool isolate = false;
+    bool binary = false;
+    // Runs on a replica when the connection has any.
+    bool readOnly = false;
+    Priority priority = Priority::Interactive;
+    // Set as `code` on the error the op rejects with.
+    std::string errorCode;
+    RowMode rowMode = RowMode::Objects;
+    std::shared_ptr<RowStream> stream;
+    std::shared_ptr<CopyStream> copy;
+    // With no statements, this op pins a connection to the session.
+    std::shared_ptr<Session> session;
+    // An auto-batched pipeline: statement i belongs to batch[i], which is
+    // settled on its own.
+    std::vector<std::unique_ptr<QueryOp>> batch;
+    // Set for object-mode queries that opted into the result cache.
+    std::unique_ptr<CachePolicy> cache;
+    // Set for object-mode queries that want columns as zero-copy Buffers.
+    std::unique_ptr<BufferColumns> buffers;
+    std::shared_ptr<Cancel> cancel;
+    std::chrono::steady_clock::time_point queuedAt;
+    // For metrics: when JS submitted the op, when it went out on a
+    // connection (unset if it never did) and when its last result came back.
+    std::chrono::steady_clock::time_point submittedAt;
+    std::chrono::steady_clock::time_point startedAt;
+    std::chrono::steady_clock::time_point finishedAt;
+    Napi::Promise::Deferred deferred;
+
+    explicit QueryOp(Napi::Env env) : deferred(Napi::Promise::Deferred::New(env)) {}
+};
+
+std::string ResultError(const PGresult* res);
+std::string ConnectionError(PGconn* conn);
+
+// Runs queries with libpq's async API on pooled sockets polled by the Node
+// event loop, so in-flight queries are bounded by the pool, not the libuv
+// threadpool. Queued queries hold one request each in the pool's wait queue;
+// connections it grants on other threads come back through a uv_async.
+class QueryEngine : public std::enable_shared_from_this<QueryEngine> {
+public:
+    QueryEngine(Napi::Env env, std::shared_ptr<ConnectionPool> pool, EngineOptions options = {},
+                std::shared_ptr<ReplicaSet> replicas = nullptr);
+    ~QueryEngine();
+
+    Napi::Promise submit(std::unique_ptr<QueryOp> op);
+    void close();
+    // For an environment being torn down, e.g. an exiting worker thread:
+    // hands every connection back to the pool without calling into JS.
+    void teardown();
+
+    ResultCache* cache() { return cache_.get(); }
+    // Handles a NOTIFY on the cache channel: its payload is a comma-separated
+    // list of tags, and an empty payload or "*" clears everything.
+    void invalidate(const std::string& payload);
+
+    const QueryMetrics& metrics() const { return metrics_; }
+    // Calls `callback` with a summary of every query that takes at least
+    // `threshold` from submission to settling.
+    void onSlowQuery(std::chrono::milliseconds threshold, Napi::Function callback);
+
+    // Resolves once a connection is pinned to `session`; later ops carrying
+    // the session run on it.
+    Napi::Promise connect(const std::shared_ptr<Session>& session);
+    // Unpins the connection once the session's queued queries finish. It goes
+    // back to the pool unless `discard` is set or a transaction is still
+    // open, in which case it is closed.
+    void release(const std::shared_ptr<Session>& session, bool discard);
+
+    // Resolves with the stream's next batch of rows, or null once it is done.
+    Napi::Promise next(const std::shared_ptr<RowStream>& stream);
+    // Ends a stream early. A running query's connection is dropped rather
+    // than read to the end.
+    void cancel(const std::shared_ptr<RowStream>& stream);
+
+    // copyTo: resolves with the next Buffer of COPY data, or null at the end.
+    Napi::Promise readCopy(const std::shared_ptr<CopyStream>& copy);
+    // copyFrom: queues one chunk; resolves once libpq has accepted it.
+    Napi::Promise writeCopy(const std::shared_ptr<CopyStream>& copy, std::string data);
+    // copyFrom: ends the data, or aborts the COPY when `reason` is set.
+    void endCopy(const std::shared_ptr<CopyStream>& copy, std::string reason);
+    void cancel(const std::shared_ptr<CopyStream>& copy);
+
+private:
+    // One protocol command sent on the connection, in order; several may
+    // belong to the same statement when it has to be prepared first.
+    struct Slot {
+        size_t statement;
+        CommandKind kind;
+        bool prepared;
+    };
+
+    struct Lane;
+
+    struct Task {
+        uv_poll_t poll;
+        std::shared_ptr<QueryEngine> engine;
+        // Where the connection goes back to: the primary's pool (host -1) or
+        // a replica's, and the lane whose queued ops it may take over.
+        std::shared_ptr<ConnectionPool> pool;
+        int host = -1;
+        Lane* lane = nullptr;
+        std::shared_ptr<PgConnection> conn;
+        std::unique_ptr<QueryOp> op;
+        std::shared_ptr<Session> session;
+        size_t current = 0;
+        size_t syncs = 0;
+        int events = 0;
+        bool inStatement = false;
+        bool pipelined = false;
+        bool flushing = false;
+        bool broken = false;
+        bool paused = false;
+        // A cancel request went to the server; whether it answered with
+        // query_canceled.
+        bool cancelSent = false;
+        bool cancelAcked = false;
+        std::vector<Slot> slots;
+        std::vector<PGresult*> results;
+        std::vector<std::string> errors;
+
+        size_t statementIndex() const {
+            return slots.empty() ? 0 : slots[std::min(current, slots.size() - 1)].statement;
+        }
+        void fail(std::string msg) { fail(std::move(msg), statementIndex()); }
+        void fail(std::string msg, size_t index) {
+            if (errors[index].empty()) errors[index] = std::move(msg);
+        }
+    };
+
+    // An op that has finished on its connection but whose promise is not
+    // settled yet.
+    struct Completion {
+        std::unique_ptr<QueryOp> op;
+        std::vector<PGresult*> results;
+        std::vector<std::string> errors;
+    };
+
+    // What metrics keep of a settled query. It outlives the op when the
+    // rows are still being decoded on a worker.
+    struct Sample {
+        // For the slow-query hook, so only kept while there is one.
+        std::vector<std::string> sql;
+        size_t statements = 0;
+        std::chrono::steady_clock::time_point submittedAt;
+        std::chrono::steady_clock::time_point startedAt;
+        std::chrono::steady_clock::time_point finishedAt;
+        uint64_t rows = 0;
+        uint64_t bytes = 0;
+        std::string error;
+        bool cached = false;
+    };
+
+    struct Grant {
+        uint64_t request;
+        std::shared_ptr<ConnectionPool> pool;
+        std::shared_ptr<PgConnection> conn;
+        std::string error;
+        bool shed;
+    };
+
+    // Where pool callbacks leave their grants. It outlives the engine until
+    // its handle has closed, since the pool may call back at any time.
+    struct Mailbox {
+        uv_async_t async;
+        std::mutex mutex;
+        std::vector<Grant> grants;
+        bool closed = false;
+        QueryEngine* engine = nullptr;
+        std::shared_ptr<Mailbox> self;
+    };
+
+    struct Request {
+        uint64_t id;
+        ConnectionPool::Ticket ticket;
+        std::shared_ptr<ConnectionPool> pool;
+        int host;
+    };
+
+    // Ops waiting for a connection, and one pool request per op, per route
+    // and priority. Writes go to the primary; reads to whichever replica is
+    // picked per request.
+    struct Lane {
+        bool readOnly;
+        Priority priority;
+        std::deque<std::unique_ptr<QueryOp>> pending;
+        std::deque<Request> requests;
+    };
+
+    static void OnPoll(uv_poll_t* handle, int status, int events);
+    static void OnGrant(uv_async_t* handle);
+    static void OnTimer(uv_timer_t* handle);
+    static void OnBatchTimer(uv_timer_t* handle);
+    static void OnDeadline(uv_timer_t* handle);
+    static void OnSettle(uv_check_t* handle);
+
+    Lane& lane(bool readOnly, Priority priority) {
+        return lanes_[(priority == Priority::Batch ? 2 : 0) + (readOnly ? 1 : 0)];
+    }
+    void dispatch();
+    void dispatch(Lane& lane);
+    void request(Lane& lane);
+    void granted(Grant grant);
+    void expire();
+    void armTimer();
+    void flushBatch();
+    // Starts the op's timeout and signal watch; false if it is already aborted.
+    bool arm(QueryOp& op);
+    void disarm(QueryOp& op);
+    void abort(const std::shared_ptr<Cancel>& cancel, Napi::Value reason, const std::string& message);
+    void requestCancel(Task* task);
+    void schedule(const std::shared_ptr<Cancel>& cancel, std::chrono::steady_clock::time_point at);
+    void armDeadlines();
+    void expireDeadlines();
+    void start(Lane& lane, std::shared_ptr<ConnectionPool> pool, int host, std::shared_ptr<PgConnection> conn,
+               std::unique_ptr<QueryOp> op);
+    void run(Task* task, std::unique_ptr<QueryOp> op);
+    bool send(Task* task);
+    bool flush(Task* task);
+    void watch(Task* task, int events);
+    void service(Task* task, int status, int events);
+    void drain(Task* task);
+    void collect(Task* task, PGresult* res);
+    void complete(Task* task, bool reusable);
+    std::unique_ptr<QueryOp> handOff(Task* task);
+    void retire(Task* task, bool healthy);
+    void settleCompleted();
+    void dropCompleted();
+    void settle(QueryOp& op, std::vector<PGresult*>& results, const std::vector<std::string>& errors);
+    // True when a worker settles the op, which then records `sample` itself.
+    bool resolve(QueryOp& op, std::vector<PGresult*>& results, const std::vector<std::string>& errors, Sample& sample);
+    Sample sampleOf(const QueryOp& op, uint64_t rows, uint64_t bytes, std::string error) const;
+    Decoded recordWhenDecoded(Sample& sample);
+    void record(const Sample& sample, std::chrono::steady_clock::duration decode);
+    void reportSlow(const Sample& sample);
+    void abandon(QueryOp& op, const std::string& error);
+    void failPending(Lane& lane, const std::string& error);
+    void resolveCached(QueryOp& op, const PGresult* result);
+    void pin(Task* task, std::unique_ptr<QueryOp> op);
+    void unpin(Task* task);
+    void dropSession(Session& session, const std::string& error);
+    void emit(RowStream& stream);
+    void endStream(QueryOp& op, const std::string& error);
+    bool pumpCopy(Task* task);
+    bool pumpCopyIn(Task* task);
+    bool pumpCopyOut(Task* task);
+    void deliverCopy(CopyStream& copy);
+    void finishCopy(QueryOp& op, const std::vector<PGresult*>& results, const std::string& error);
+    void resume(Task* task);
+    // The task running the stream or COPY whose channel object is `channel`,
+    // or holding the pinned session.
+    Task* findTask(const void* channel) const;
+    void cancelChannel(const void* channel);
+    void notePrepareCandidates(QueryOp& op);
+
+    Napi::Env env_;
+    uv_loop_t* loop_;
+    std::shared_ptr<ConnectionPool> pool_;
+    std::shared_ptr<ReplicaSet> replicas_;
+    EngineOptions options_;
+    Napi::AsyncContext context_;
+    // Interactive lanes come first so they are dispatched first.
+    std::array<Lane, 4> lanes_{{{false, Priority::Interactive, {}, {}},
+                                {true, Priority::Interactive, {}, {}},
+                                {false, Priority::Batch, {}, {}},
+                                {true, Priority::Batch, {}, {}}}};
+    std::unordered_set<Task*> active_;
+    std::unordered_map<std::string, uint32_t> sightings_;
+    uint64_t nextRequest_ = 1;
+    std::shared_ptr<Mailbox> mailbox_;
+    uv_timer_t* timer_ = nullptr;
+    std::vector<std::unique_ptr<QueryOp>> batch_;
+    std::unique_ptr<ResultCache> cache_;
+    uv_timer_t* batchTimer_ = nullptr;
+    std::multimap<std::chrono::steady_clock::time_point, std::weak_ptr<Cancel>> deadlines_;
+    uv_timer_t* deadlineTimer_ = nullptr;
+    std::vector<Completion> completed_;
+    // Settle completed_ once per loop iteration, after the poll phase; the
+    // idle handle keeps poll from blocking while any are waiting.
+    uv_check_t* settleCheck_ = nullptr;
+    uv_idle_t* settleIdle_ = nullptr;
+    QueryMetrics metrics_;
+    std::chrono::milliseconds slowQuery_{0};
+    Napi::FunctionReference slowQueryHook_;
+    bool closed_ = false;
+};
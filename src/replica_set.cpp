@@ -0,0 +1,74 @@
+#include "replica_set.h"
+#include <algorithm>
+
+std::string ReplicaSet::HostName(const std::string& connStr) {
+    PQconninfoOption* options = PQconninfoParse(connStr.c_str(), nullptr);
+    if (!options) return "";
+    std::string host, port;
+    for (auto* opt = options; opt->keyword; ++opt) {
+        if (!opt->val) continue;
+        std::string keyword = opt->keyword;
+        if (keyword == "host" || (keyword == "hostaddr" && host.empty())) host = opt->val;
+        if (keyword == "port") port = opt->val;
+    }
+    PQconninfoFree(options);
+    return port.empty() ? host : host + ':' + port;
+}
+
+void ReplicaSet::add(const std::string& connStr, std::shared_ptr<ConnectionPool> pool) {
+    ReplicaHost host;
+    host.name = HostName(connStr);
+    host.pool = std::move(pool);
+    hosts_.push_back(std::move(host));
+}
+
+bool ReplicaSet::ejected(const ReplicaHost& host) const {
+    return std::chrono::steady_clock::now() < host.ejectedUntil || host.pool->closed();
+}
+
+int ReplicaSet::pick() {
+    int best = -1;
+    double bestScore = 0;
+    for (size_t n = 0; n < hosts_.size(); ++n) {
+        size_t i = (next_ + n) % hosts_.size();
+        const auto& host = hosts_[i];
+        if (ejected(host)) continue;
+        // Unmeasured replicas score 0 so they get sampled.
+        double score = balance_ == Balance::Latency ? host.latencyMs * (host.outstanding + 1)
+                                                    : static_cast<double>(host.outstanding);
+        if (best < 0 || score < bestScore) {
+            best = static_cast<int>(i);
+            bestScore = score;
+        }
+    }
+    if (!hosts_.empty()) next_ = (next_ + 1) % hosts_.size();
+    return best;
+}
+
+void ReplicaSet::begin(int host) {
+    if (host >= 0) hosts_[host].outstanding++;
+}
+
+void ReplicaSet::end(int host) {
+    if (host >= 0 && hosts_[host].outstanding > 0) hosts_[host].outstanding--;
+}
+
+void ReplicaSet::observe(int host, std::chrono::steady_clock::duration took) {
+    if (host < 0) return;
+    auto& replica = hosts_[host];
+    double ms = std::chrono::duration<double, std::milli>(took).count();
+    replica.latencyMs = replica.queries++ ? replica.latencyMs + LATENCY_WEIGHT * (ms - replica.latencyMs) : ms;
+    replica.failures = 0;
+}
+
+// Failures reported while a replica is already out don't extend its time.
+void ReplicaSet::fail(int host) {
+    if (host < 0) return;
+    auto& replica = hosts_[host];
+    auto now = std::chrono::steady_clock::now();
+    if (now < replica.ejectedUntil) return;
+    auto ejection = MIN_EJECTION * (1 << std::min<uint32_t>(replica.failures, 6));
+    replica.ejectedUntil = now + std::min<std::chrono::seconds>(ejection, MAX_EJECTION);
+    replica.failures++;
+    replica.ejections++;
+}
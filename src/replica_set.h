@@ -0,0 +1,60 @@
+#pragma once
+#include "connection_pool.h"
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// How reads pick a replica: fewest queries outstanding, or lowest recent
+// latency weighted by how busy the replica already is.
+enum class Balance { LeastOutstanding, Latency };
+
+struct ReplicaHost {
+    // host:port from the connection string, never its credentials.
+    std::string name;
+    std::shared_ptr<ConnectionPool> pool;
+    // Requests queued on this replica's pool plus queries running on it.
+    size_t outstanding = 0;
+    // Moving average of execute time, in ms; 0 until the first sample.
+    double latencyMs = 0;
+    uint64_t queries = 0;
+    // In a row, since the last query that completed.
+    uint32_t failures = 0;
+    uint64_t ejections = 0;
+    std::chrono::steady_clock::time_point ejectedUntil;
+};
+
+// The streaming replicas that read-only queries are spread over, each with a
+// pool of its own. A replica whose connections fail is ejected for a while,
+// longer each time it fails again, and reads fall back to the primary while
+// every replica is out. Used from one engine's JS thread only.
+class ReplicaSet {
+public:
+    explicit ReplicaSet(Balance balance) : balance_(balance) {}
+
+    static std::string HostName(const std::string& connStr);
+
+    void add(const std::string& connStr, std::shared_ptr<ConnectionPool> pool);
+    // The replica the next read should use, or -1 for the primary.
+    int pick();
+    void begin(int host);
+    void end(int host);
+    // A query finished on `host` and its connection is fine.
+    void observe(int host, std::chrono::steady_clock::duration took);
+    // A connection to `host` failed or was lost.
+    void fail(int host);
+
+    bool ejected(const ReplicaHost& host) const;
+    const std::shared_ptr<ConnectionPool>& pool(int host) const { return hosts_[host].pool; }
+    const std::vector<ReplicaHost>& hosts() const { return hosts_; }
+
+private:
+    Balance balance_;
+    std::vector<ReplicaHost> hosts_;
+    // Where ties start, so equal replicas take turns.
+    size_t next_ = 0;
+    static constexpr double LATENCY_WEIGHT = 0.2;
+    static constexpr std::chrono::seconds MIN_EJECTION{1};
+    static constexpr std::chrono::seconds MAX_EJECTION{60};
+};
@@ -0,0 +1,144 @@
+#include "result_buffer.h"
+#include "pg_types.h"
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+
+static ResultBuffer::Kind KindOf(Oid type, bool binary) {
+    using Kind = ResultBuffer::Kind;
+    if (!binary) {
+        switch (type) {
+            case BOOLOID: return Kind::Bool;
+            case INT2OID:
+            case INT4OID:
+            case INT8OID:
+            case FLOAT4OID:
+            case FLOAT8OID: return Kind::Number;
+            default: return Kind::Text;
+        }
+    }
+    switch (type) {
+        case BOOLOID: return Kind::Bool;
+        case INT2OID:
+        case INT4OID:
+        case OIDOID:
+        case FLOAT4OID:
+        case FLOAT8OID: return Kind::Number;
+        case INT8OID: return Kind::Int64;
+        case TIMESTAMPOID:
+        case TIMESTAMPTZOID: return Kind::Timestamp;
+        case TEXTOID:
+        case VARCHAROID:
+        case BPCHAROID:
+        case NAMEOID:
+        case CHAROID:
+        case JSONOID:
+        case JSONBOID:
+        case XMLOID:
+        case UNKNOWNOID: return Kind::Text;
+        default: return Kind::Binary;
+    }
+}
+
+static double BinaryNumber(Oid type, const char* value) {
+    switch (type) {
+        case INT2OID: return static_cast<int16_t>(ReadU16(value));
+        case INT4OID: return static_cast<int32_t>(ReadU32(value));
+        case OIDOID: return ReadU32(value);
+        case FLOAT4OID: {
+            uint32_t bits = ReadU32(value);
+            float f;
+            std::memcpy(&f, &bits, sizeof(f));
+            return f;
+        }
+        default: {
+            uint64_t bits = ReadU64(value);
+            double d;
+            std::memcpy(&d, &bits, sizeof(d));
+            return d;
+        }
+    }
+}
+
+ResultBuffer::ResultBuffer(const PGresult* result) {
+    if (!result) return;
+    rows_ = PQntuples(result);
+    int cols = PQnfields(result);
+
+    std::vector<bool> binary(cols);
+    size_t textBytes = 0;
+    columns_.reserve(cols);
+    for (int j = 0; j < cols; ++j) {
+        binary[j] = PQfformat(result, j) == 1;
+        Oid type = PQftype(result, j);
+        columns_.push_back({PQfname(result, j), type, KindOf(type, binary[j])});
+
+        auto kind = columns_[j].kind;
+        if (kind != Kind::Text && kind != Kind::Binary) continue;
+        for (int i = 0; i < rows_; ++i) textBytes += PQgetlength(result, i, j);
+    }
+    if (textBytes > std::numeric_limits<uint32_t>::max()) {
+        throw std::length_error("Result too large to decode");
+    }
+
+    size_t cellCount = static_cast<size_t>(rows_) * cols;
+    cells_.resize(cellCount);
+    nulls_.assign((cellCount + 63) / 64, 0);
+    arena_.reserve(textBytes);
+
+    for (int i = 0; i < rows_; ++i) {
+        for (int j = 0; j < cols; ++j) {
+            size_t at = index(i, j);
+            if (PQgetisnull(result, i, j)) {
+                nulls_[at / 64] |= uint64_t(1) << (at % 64);
+                continue;
+            }
+
+            const char* value = PQgetvalue(result, i, j);
+            int length = PQgetlength(result, i, j);
+            const auto& col = columns_[j];
+            auto& cell = cells_[at];
+            switch (col.kind) {
+                case Kind::Bool:
+                    cell.flag = binary[j] ? value[0] != 0 : value[0] == 't';
+                    break;
+                case Kind::Number:
+                    if (binary[j]) {
+                        cell.number = BinaryNumber(col.type, value);
+                    } else if (col.type == FLOAT4OID || col.type == FLOAT8OID) {
+                        cell.number = std::strtod(value, nullptr);
+                    } else {
+                        cell.number = static_cast<double>(std::strtoll(value, nullptr, 10));
+                    }
+                    break;
+                case Kind::Int64:
+                    cell.integer = static_cast<int64_t>(ReadU64(value));
+                    break;
+                case Kind::Timestamp: {
+                    auto micros = static_cast<int64_t>(ReadU64(value));
+                    if (micros == std::numeric_limits<int64_t>::max()) {
+                        cell.number = std::numeric_limits<double>::infinity();
+                    } else if (micros == std::numeric_limits<int64_t>::min()) {
+                        cell.number = -std::numeric_limits<double>::infinity();
+                    } else {
+                        cell.number = std::floor(micros / 1000.0) + POSTGRES_EPOCH_MS;
+                    }
+                    break;
+                }
+                case Kind::Text:
+                case Kind::Binary:
+                    // jsonb's binary form is a version byte followed by the text.
+                    if (binary[j] && col.type == JSONBOID && length > 0) {
+                        ++value;
+                        --length;
+                    }
+                    cell.bytes.offset = static_cast<uint32_t>(arena_.size());
+                    cell.bytes.length = static_cast<uint32_t>(length);
+                    arena_.insert(arena_.end(), value, value + length);
+                    break;
+            }
+        }
+    }
+}
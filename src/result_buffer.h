@@ -0,0 +1,64 @@
+#pragma once
+#include <libpq-fe.h>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// A query result decoded into plain memory, with no libpq or N-API state, so
+// it can be built on a worker thread and the PGresult freed there. Numbers
+// are parsed up front; text and raw bytes live in one arena addressed by
+// offset; NULLs are a bitmap. Cells are stored row-major.
+class ResultBuffer {
+public:
+    enum class Kind : uint8_t {
+        Bool,       // flag
+        Number,     // number
+        Int64,      // integer; a BigInt once outside the safe range
+        Timestamp,  // number: Unix ms, or +/-infinity
+        Text,       // bytes: UTF-8
+        Binary      // bytes: binary-format value for DecodeBinary
+    };
+
+    struct Column {
+        std::string name;
+        Oid type;
+        Kind kind;
+    };
+
+    union Cell {
+        bool flag;
+        int64_t integer;
+        double number;
+        struct {
+            uint32_t offset;
+            uint32_t length;
+        } bytes;
+    };
+
+    // Throws std::length_error if the text would not fit 32-bit offsets.
+    explicit ResultBuffer(const PGresult* result);
+
+    int rowCount() const { return rows_; }
+    int columnCount() const { return static_cast<int>(columns_.size()); }
+    const Column& column(int col) const { return columns_[col]; }
+
+    bool isNull(int row, int col) const {
+        size_t bit = index(row, col);
+        return (nulls_[bit / 64] >> (bit % 64)) & 1;
+    }
+    const Cell& cell(int row, int col) const { return cells_[index(row, col)]; }
+    const char* bytes(const Cell& cell) const { return arena_.data() + cell.bytes.offset; }
+
+    size_t byteSize() const {
+        return cells_.size() * sizeof(Cell) + nulls_.size() * sizeof(uint64_t) + arena_.size();
+    }
+
+private:
+    size_t index(int row, int col) const { return static_cast<size_t>(row) * columns_.size() + col; }
+
+    int rows_ = 0;
+    std::vector<Column> columns_;
+    std::vector<Cell> cells_;
+    std::vector<uint64_t> nulls_;
+    std::vector<char> arena_;
+};
@@ -0,0 +1,101 @@
+#include "result_cache.h"
+#include <iterator>
+
+// Rough per-entry bookkeeping on top of the key and decoded rows.
+static constexpr size_t ENTRY_OVERHEAD = 128;
+
+ResultCache::ResultCache(size_t maxBytes, std::chrono::milliseconds ttl) : maxBytes_(maxBytes), ttl_(ttl) {
+    stats_.maxBytes = maxBytes;
+}
+
+// Length-prefixed so no two different queries share a key.
+std::string ResultCache::key(const std::string& sql, const QueryParams& params, bool binary) {
+    std::string key;
+    key.reserve(sql.size() + 16 * params.values.size() + 16);
+    key += binary ? 'b' : 't';
+    key += std::to_string(sql.size()) + ':' + sql;
+    for (int i = 0; i < params.size(); ++i) {
+        key += params.nulls[i] ? 'n' : params.formats[i] == 1 ? 'b' : 't';
+        key += std::to_string(params.types[i]) + ':';
+        if (params.nulls[i]) continue;
+        key += std::to_string(params.values[i].size()) + ':' + params.values[i];
+    }
+    return key;
+}
+
+std::shared_ptr<const ResultBuffer> ResultCache::find(const std::string& key) {
+    auto it = index_.find(key);
+    if (it == index_.end()) {
+        stats_.misses++;
+        return nullptr;
+    }
+    if (std::chrono::steady_clock::now() >= it->second->expires) {
+        erase(it->second);
+        stats_.misses++;
+        return nullptr;
+    }
+    lru_.splice(lru_.begin(), lru_, it->second);
+    stats_.hits++;
+    return it->second->rows;
+}
+
+void ResultCache::put(const CachePolicy& policy, std::shared_ptr<const ResultBuffer> rows) {
+    if (policy.generation != generation_) return;
+    size_t bytes = rows->byteSize() + policy.key.size() + ENTRY_OVERHEAD;
+    if (bytes > maxBytes_) return;
+
+    auto existing = index_.find(policy.key);
+    if (existing != index_.end()) erase(existing->second);
+    while (bytes_ + bytes > maxBytes_ && !lru_.empty()) {
+        erase(std::prev(lru_.end()));
+        stats_.evictions++;
+    }
+
+    auto ttl = policy.ttl.count() > 0 ? policy.ttl : ttl_;
+    lru_.push_front({policy.key, std::move(rows), policy.tags, std::chrono::steady_clock::now() + ttl, bytes});
+    index_[policy.key] = lru_.begin();
+    for (const auto& tag : policy.tags) tagged_[tag].insert(policy.key);
+    bytes_ += bytes;
+}
+
+void ResultCache::invalidate(const std::string& tag) {
+    generation_++;
+    stats_.invalidations++;
+    auto it = tagged_.find(tag);
+    if (it == tagged_.end()) return;
+
+    auto keys = std::move(it->second);
+    tagged_.erase(it);
+    for (const auto& key : keys) {
+        auto entry = index_.find(key);
+        if (entry != index_.end()) erase(entry->second);
+    }
+}
+
+void ResultCache::clear() {
+    generation_++;
+    stats_.invalidations++;
+    lru_.clear();
+    index_.clear();
+    tagged_.clear();
+    bytes_ = 0;
+}
+
+CacheStats ResultCache::stats() const {
+    CacheStats stats = stats_;
+    stats.entries = index_.size();
+    stats.bytes = bytes_;
+    return stats;
+}
+
+void ResultCache::erase(Iterator it) {
+    for (const auto& tag : it->tags) {
+        auto keys = tagged_.find(tag);
+        if (keys == tagged_.end()) continue;
+        keys->second.erase(it->key);
+        if (keys->second.empty()) tagged_.erase(keys);
+    }
+    bytes_ -= it->bytes;
+    index_.erase(it->key);
+    lru_.erase(it);
+}
@@ -0,0 +1,70 @@
+#pragma once
+#include "params.h"
+#include "result_buffer.h"
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// How one query's result is cached. `generation` is the cache's at submit
+// time; a result that raced an invalidation is not stored.
+struct CachePolicy {
+    std::string key;
+    std::vector<std::string> tags;
+    std::chrono::milliseconds ttl{0};
+    uint64_t generation = 0;
+};
+
+struct CacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    uint64_t invalidations = 0;
+    size_t entries = 0;
+    size_t bytes = 0;
+    size_t maxBytes = 0;
+};
+
+// Decoded results of repeated queries, keyed by SQL and parameter values,
+// bounded in bytes and evicted least-recently-used. Entries expire after
+// their TTL and can be dropped by tag. Used from the JS thread only.
+class ResultCache {
+public:
+    ResultCache(size_t maxBytes, std::chrono::milliseconds ttl);
+
+    static std::string key(const std::string& sql, const QueryParams& params, bool binary);
+
+    std::shared_ptr<const ResultBuffer> find(const std::string& key);
+    void put(const CachePolicy& policy, std::shared_ptr<const ResultBuffer> rows);
+    // Drops every entry carrying `tag`.
+    void invalidate(const std::string& tag);
+    void clear();
+
+    uint64_t generation() const { return generation_; }
+    CacheStats stats() const;
+
+private:
+    struct Entry {
+        std::string key;
+        std::shared_ptr<const ResultBuffer> rows;
+        std::vector<std::string> tags;
+        std::chrono::steady_clock::time_point expires;
+        size_t bytes;
+    };
+    using Iterator = std::list<Entry>::iterator;
+
+    void erase(Iterator it);
+
+    size_t maxBytes_;
+    std::chrono::milliseconds ttl_;
+    size_t bytes_ = 0;
+    uint64_t generation_ = 0;
+    std::list<Entry> lru_;
+    std::unordered_map<std::string, Iterator> index_;
+    std::unordered_map<std::string, std::unordered_set<std::string>> tagged_;
+    CacheStats stats_;
+};